@@ -1,3 +1,5 @@
+#define _GNU_SOURCE // madvise, pread and fmemopen are hidden under -std=c11 otherwise
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,10 +7,48 @@
 #include <ctype.h>
 #include <stdarg.h>
 #include <errno.h>
+#include <stdint.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#endif
+
+#ifdef __linux__ // Server mode
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#ifndef NO_THREADS // Build with -DNO_THREADS where pthreads is not available
+#include <pthread.h>
+#endif
 
 
 /*B Tree parameters*/
-#define MIN_DEGREE 2 // Also used to refer to minimum nyumber of children
+#ifndef MIN_DEGREE
+#define MIN_DEGREE 16 // Also used to refer to minimum nyumber of children, override with -DMIN_DEGREE=<t> (e.g. 8, 16, 32)
+#endif
+#if MIN_DEGREE < 2
+#error "MIN_DEGREE must be at least 2"
+#endif
 #define MAX_KEYS (2 * MIN_DEGREE - 1)
 #define MIN_KEYS (MIN_DEGREE - 1) 
 #define MAX_CHILDREN (MIN_DEGREE * 2)
@@ -22,7 +62,6 @@
 /*Max values for struct*/
 #define MAX_NAME 100
 #define MAX_PROGRAMME 100
-#define MAX_LINE (MAX_NAME + MAX_PROGRAMME + 20) // Max amount of characters to read from database
 #define MAX_INPUT 100
 #define MIN_ID 1000000
 #define MAX_ID 9999999
@@ -31,103 +70,837 @@
 
 
 
-typedef struct StudentRecord{ // 4 + 100 + 100 + 4 = 208
+typedef struct StudentRecord{ // 4 + 4 + 4 + 4 + 8 + 2 + 1 = 27, 32 with padding
     int id;
-    char name[MAX_NAME];
-    char programme[MAX_PROGRAMME];
     float mark;
+    int slot; // Where the mark sits in mark_column
+    uint32_t version; // Odd while a writer is changing the fields, see versionLock
+    char *name; // Slot in name_heap, see nameStore
+    uint16_t programme; // Code in the programme dictionary, see programmeText
+    uint8_t name_len;
 } StudentRecord;
 
-typedef struct BTreeNode { //16 + 16 + 16 + 1 = 49 bits roughly equivalent to 12 bytes
+/* A record copied out for a reader running alongside writers, the name comes along since its slot can be freed */
+typedef struct RecordCopy {
+    StudentRecord rec; // rec.name points at name below
+    char name[MAX_NAME];
+} RecordCopy;
+
+typedef uint64_t BTreeKey; // What a tree is ordered by: the id in the primary index, markKey() in the mark index
+
+typedef struct BTreeNode {
+    // Everything a search touches sits at the front: num_keys, is_leaf and the sort keys
+    // With MIN_DEGREE 16 the sort keys fill four cache lines, so a lookup inside a node never dereferences a record
     int num_keys; // Number of keys currently in the node
+    bool is_leaf;
+    int count; // Records in this node and every node under it, lets a cursor skip whole subtrees
+    uint32_t version; // Odd while a writer is changing the keys or children, see versionLock
+    BTreeKey sort_keys[MAX_KEYS]; // Key keys[i] is filed under, kept inline so the node can be searched without touching the records
     StudentRecord *keys[MAX_KEYS]; //Array of pointers to keys with struct StudentRecord
     struct BTreeNode *children[MAX_CHILDREN]; // Array of pointers to other child nodes
-    bool is_leaf;
 } BTreeNode;
 
 
-/*Sorting function*/
-int sortmarkASC(const void* a, const void* b) {
-    const StudentRecord* studentA = *(const StudentRecord**)a;
-    const StudentRecord* studentB = *(const StudentRecord**)b;
-    // Since mark is double, we need to return int
-    if (studentA->mark < studentB->mark) return -1;
-    if (studentA->mark > studentB->mark) return 1;
+/*Slab allocator parameters*/
+#define SLAB_MIN_OBJECTS 64 // First slab of a pool holds this many objects, each later slab doubles
+#define SLAB_MAX_OBJECTS 65536
+#define CACHE_LINE 64
+
+typedef struct Slab {
+    struct Slab *next; // Objects follow this header in the same allocation
+} Slab;
+
+typedef struct FreeSlot {
+    struct FreeSlot *next; // Freed objects are reused to hold the free list itself
+} FreeSlot;
+
+typedef struct Pool {
+    size_t object_size; // Rounded up to the pool alignment
+    size_t align;
+    size_t slab_objects; // Size of the next slab to allocate
+    Slab *slabs; // Every slab the pool owns, released together by poolDestroy
+    char *bump; // Next never used object in the newest slab
+    char *bump_end;
+    FreeSlot *free_list;
+    size_t allocations; // Counted for SHOW STATS, poolDestroy counts every live object as freed
+    size_t frees;
+    size_t slab_bytes; // Held right now
+} Pool;
+
+#define POOL_INIT_SIZE(size, alignment) {((size) + (alignment) - 1) / (alignment) * (alignment), alignment, SLAB_MIN_OBJECTS, NULL, NULL, NULL, NULL, 0, 0, 0}
+#define POOL_INIT(type, alignment) POOL_INIT_SIZE(sizeof(type), alignment)
+
+// One pool per object type, records and nodes each sit next to their own kind
+Pool record_pool = POOL_INIT(StudentRecord, sizeof(void *));
+Pool node_pool = POOL_INIT(BTreeNode, CACHE_LINE);
+
+// Names are kept out of the records in the smallest slot that fits, most names fit the first class
+#define NAME_CLASSES 4 // Slots of 16, 32, 64 and 128 bytes
+#define NAME_HEAP_INIT {POOL_INIT_SIZE(16, sizeof(void *)), POOL_INIT_SIZE(32, sizeof(void *)), \
+                        POOL_INIT_SIZE(64, sizeof(void *)), POOL_INIT_SIZE(128, sizeof(void *))}
+Pool name_heap[NAME_CLASSES] = NAME_HEAP_INIT;
+
+// Secondary index over the same records as the primary tree, ordered by (mark, id)
+// Kept in sync wherever a record enters or leaves the database, see indexRecord and unindexRecord
+BTreeNode *mark_index = NULL;
+
+// Running totals over every mark in the database, kept alongside the mark index so SHOW SUMMARY never walks the tree
+typedef struct MarkStats {
+    int count;
+    double sum;
+    double sum_squares;
+} MarkStats;
+
+MarkStats mark_stats = {0, 0, 0};
+
+void statsAdd(float mark) {
+    mark_stats.count++;
+    mark_stats.sum += mark;
+    mark_stats.sum_squares += (double)mark * mark;
+}
+
+void statsRemove(float mark) {
+    mark_stats.count--;
+    if (mark_stats.count == 0) {
+        // Start from exact zeros again instead of carrying rounding leftovers
+        mark_stats.sum = 0;
+        mark_stats.sum_squares = 0;
+        return;
+    }
+    mark_stats.sum -= mark;
+    mark_stats.sum_squares -= (double)mark * mark;
+}
+
+/* ========== Buffered output ========== */
+
+/*
+ * Everything a command prints goes through an OutBuffer: rows are formatted by hand straight into
+ * the buffer, messages with outPrintf, and both are handed to stdio in OUT_BUFFER_SIZE writes.
+ * The buffer's file is the command's sink, stdout at the prompt or the client's reply in server mode.
+ */
+#define OUT_BUFFER_SIZE (1 << 16)
+
+typedef struct OutBuffer {
+    FILE *file;
+    bool csv; // Records go out as CSV lines instead of table rows
+    bool failed;
+    size_t used;
+    char data[OUT_BUFFER_SIZE];
+} OutBuffer;
+
+OutBuffer *outOpen(FILE *file, bool csv){
+    OutBuffer *out = malloc(sizeof(OutBuffer));
+    if (out == NULL){
+        return NULL;
+    }
+    out->file = file;
+    out->csv = csv;
+    out->failed = false;
+    out->used = 0;
+    return out;
+}
+
+void outFlush(OutBuffer *out){
+    if (out->used > 0 && fwrite(out->data, 1, out->used, out->file) != out->used){
+        out->failed = true;
+    }
+    out->used = 0;
+}
+
+void outBytes(OutBuffer *out, const char *bytes, size_t len){
+    while (len > 0){
+        if (out->used == OUT_BUFFER_SIZE) outFlush(out);
+        size_t room = OUT_BUFFER_SIZE - out->used;
+        size_t n = len < room ? len : room;
+        memcpy(out->data + out->used, bytes, n);
+        out->used += n;
+        bytes += n;
+        len -= n;
+    }
+}
+
+void outChar(OutBuffer *out, char c){
+    if (out->used == OUT_BUFFER_SIZE) outFlush(out);
+    out->data[out->used++] = c;
+}
+
+/* printf into the buffer, for messages between the records */
+void outVprintf(OutBuffer *out, const char *format, va_list args){
+    va_list again;
+    va_copy(again, args);
+    size_t room = OUT_BUFFER_SIZE - out->used;
+    int len = vsnprintf(out->data + out->used, room, format, args);
+    if (len >= 0 && (size_t)len < room){
+        out->used += len;
+    }
+    else if (len >= 0){
+        // Did not fit, make room, or write it straight through if it is longer than the whole buffer
+        outFlush(out);
+        if ((size_t)len < OUT_BUFFER_SIZE) out->used = vsnprintf(out->data, OUT_BUFFER_SIZE, format, again);
+        else if (vfprintf(out->file, format, again) < 0) out->failed = true;
+    }
+    va_end(again);
+}
+
+void outPrintf(OutBuffer *out, const char *format, ...){
+    va_list args;
+    va_start(args, format);
+    outVprintf(out, format, args);
+    va_end(args);
+}
+
+// Set while commands come from a script: no prompts or success messages, only errors and a final tally
+bool batch_mode = false;
+
+/* outPrintf for messages that only confirm a command worked, batch mode leaves them out */
+void note(OutBuffer *out, const char *format, ...) {
+    if (batch_mode) return;
+    va_list args;
+    va_start(args, format);
+    outVprintf(out, format, args);
+    va_end(args);
+}
+
+
+/* ========== Instrumentation ========== */
+
+/*
+ * Counters on the tree and allocator hot paths plus a latency histogram per command, printed by SHOW STATS.
+ * Each one is a plain increment, so only the main thread touches them, reader threads hand their counts back.
+ * Build with -DNO_STATS to compile all of it out.
+ */
+#ifndef NO_STATS
+#define STAT(statement) statement
+#else
+#define STAT(statement)
+#endif
+
+double nowSeconds(){
+#ifdef _WIN32
+    LARGE_INTEGER frequency, now;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&now);
+    return (double)now.QuadPart / frequency.QuadPart;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+#endif
+}
+
+#ifndef NO_STATS
+#define LATENCY_BUCKETS 32 // Bucket i counts commands that took under 2^i microseconds, and at least 2^(i-1)
+
+const char *command_names[] = {"open", "save", "show", "insert", "query", "update", "delete", "count", "other"};
+#define COMMAND_TYPES ((int)(sizeof(command_names) / sizeof(command_names[0])))
+
+typedef struct CommandStats {
+    unsigned long long count;
+    unsigned long long failed;
+    double seconds;
+    double slowest;
+    unsigned long long buckets[LATENCY_BUCKETS];
+} CommandStats;
+
+typedef struct Counters {
+    unsigned long long searches; // searchIndex calls
+    unsigned long long nodes_visited; // Nodes those calls looked at
+    unsigned long long splits; // In any tree, so the mark index and programme members count too
+    unsigned long long merges;
+    unsigned long long borrows;
+    CommandStats commands[COMMAND_TYPES];
+} Counters;
+
+Counters counters;
+
+/* op is the lowered command line, its first word picks the command type */
+void recordCommand(const char *op, int status, double seconds){
+    int type = 0;
+    size_t len = strcspn(op, " ");
+    while (type < COMMAND_TYPES - 1 && (strlen(command_names[type]) != len || strncmp(op, command_names[type], len) != 0)) type++;
+
+    CommandStats *stats = &counters.commands[type];
+    stats->count++;
+    if (status != 0) stats->failed++;
+    stats->seconds += seconds;
+    if (seconds > stats->slowest) stats->slowest = seconds;
+    double micros = seconds * 1e6;
+    int bucket = 0;
+    while (bucket < LATENCY_BUCKETS - 1 && micros >= (double)(1ULL << bucket)) bucket++;
+    stats->buckets[bucket]++;
+}
+#endif
+
+
+/* Slab allocator */
+void *poolAlloc(Pool *pool) {
+    STAT(pool->allocations++);
+    if (pool->free_list != NULL) {
+        FreeSlot *slot = pool->free_list;
+        pool->free_list = slot->next;
+        return slot;
+    }
+    if (pool->bump == pool->bump_end) {
+        // Current slab used up, carve the next one
+        size_t size = pool->object_size;
+        Slab *slab = calloc(1, sizeof(Slab) + pool->align + pool->slab_objects * size); // Zeroed so versions start even
+        if (slab == NULL) {
+            perror("Memory allocation failed");
+            exit(EXIT_FAILURE);
+        }
+        STAT(pool->slab_bytes += sizeof(Slab) + pool->align + pool->slab_objects * size);
+        slab->next = pool->slabs;
+        pool->slabs = slab;
+
+        // First object starts at the first aligned address after the header
+        size_t start = ((size_t)(slab + 1) + pool->align - 1) / pool->align * pool->align;
+        pool->bump = (char *)start;
+        pool->bump_end = pool->bump + pool->slab_objects * size;
+        if (pool->slab_objects < SLAB_MAX_OBJECTS) pool->slab_objects *= 2;
+    }
+    void *object = pool->bump;
+    pool->bump += pool->object_size;
+    return object;
+}
+
+void poolFree(Pool *pool, void *object) {
+    STAT(pool->frees++);
+    FreeSlot *slot = object;
+    slot->next = pool->free_list;
+    pool->free_list = slot;
+}
+
+/* Hand every slab of src over to dst, src is left empty. Both must be pools of the same type */
+void poolAdopt(Pool *dst, Pool *src) {
+    if (src->slabs == NULL) return;
+    size_t frees = dst->frees; // Moving free slots across below is not a free
+
+    // Keep the larger of the two unused slab tails for bump allocation, the other goes on the free list
+    if (src->bump_end - src->bump > dst->bump_end - dst->bump) {
+        char *bump = dst->bump, *bump_end = dst->bump_end;
+        dst->bump = src->bump;
+        dst->bump_end = src->bump_end;
+        src->bump = bump;
+        src->bump_end = bump_end;
+    }
+    for (; src->bump != src->bump_end; src->bump += src->object_size) {
+        poolFree(dst, src->bump);
+    }
+
+    Slab *last = src->slabs;
+    while (last->next != NULL) last = last->next;
+    last->next = dst->slabs;
+    dst->slabs = src->slabs;
+
+    while (src->free_list != NULL) {
+        FreeSlot *next = src->free_list->next;
+        poolFree(dst, src->free_list);
+        src->free_list = next;
+    }
+    if (src->slab_objects > dst->slab_objects) dst->slab_objects = src->slab_objects;
+
+    src->slabs = NULL;
+    src->bump = NULL;
+    src->bump_end = NULL;
+    src->slab_objects = SLAB_MIN_OBJECTS;
+
+    dst->frees = frees + src->frees;
+    dst->allocations += src->allocations;
+    dst->slab_bytes += src->slab_bytes;
+    src->allocations = 0;
+    src->frees = 0;
+    src->slab_bytes = 0;
+}
+
+/* Release every object of the pool at once */
+void poolDestroy(Pool *pool) {
+    while (pool->slabs != NULL) {
+        Slab *next = pool->slabs->next;
+        free(pool->slabs);
+        pool->slabs = next;
+    }
+    pool->bump = NULL;
+    pool->bump_end = NULL;
+    pool->free_list = NULL;
+    pool->slab_objects = SLAB_MIN_OBJECTS;
+    pool->frees = pool->allocations;
+    pool->slab_bytes = 0;
+}
+
+
+/* Mark index key: the mark in the high half so records order by mark, the id below it to break ties */
+BTreeKey markKeyFor(float mark, int id){
+    mark += 0.0f; // -0.0 files as 0.0
+    uint32_t bits;
+    memcpy(&bits, &mark, sizeof(bits));
+    // Flip the bits so unsigned order matches float order, negative floats included
+    bits = (bits & 0x80000000u) ? ~bits : bits | 0x80000000u;
+    return ((BTreeKey)bits << 32) | (uint32_t)id;
+}
+
+BTreeKey markKey(StudentRecord *rec){
+    return markKeyFor(rec->mark, rec->id);
+}
+
+/* Key rec is filed under in the primary index, or the mark index when by_mark is set */
+BTreeKey recordKey(StudentRecord *rec, bool by_mark){
+    return by_mark ? markKey(rec) : (BTreeKey)rec->id;
+}
+
+int sortmarkKeyASC(const void* a, const void* b) {
+    BTreeKey keyA = markKey(*(StudentRecord**)a);
+    BTreeKey keyB = markKey(*(StudentRecord**)b);
+    if (keyA < keyB) return -1;
+    if (keyA > keyB) return 1;
+    return 0;
+}
+
+#define MARK_TENTHS (MAX_MARK * 10 + 1) // Counting sort buckets, one per 0.1 of a mark
+#define RADIX_BITS 8
+
+/*
+ * LSD radix sort on the mark half of markKey, RADIX_BITS a pass. Each pass is stable, so records
+ * given in id order come out in markKey order. records is used as the second buffer and left scrambled.
+ */
+int radixSortByMark(StudentRecord **records, const float *marks, int n, StudentRecord **sorted){
+    uint32_t *keys = malloc(2 * (size_t)(n ? n : 1) * sizeof(uint32_t));
+    if (keys == NULL) return 1;
+    for (int i = 0; i < n; i++){
+        keys[i] = (uint32_t)(markKeyFor(marks[i], 0) >> 32);
+    }
+    uint32_t *key_from = keys, *key_to = keys + n;
+    StudentRecord **from = records, **to = sorted;
+    for (int shift = 0; shift < 32; shift += RADIX_BITS){
+        int starts[(1 << RADIX_BITS) + 1] = {0};
+        for (int i = 0; i < n; i++) starts[((key_from[i] >> shift) & ((1 << RADIX_BITS) - 1)) + 1]++;
+        for (int b = 1; b <= 1 << RADIX_BITS; b++) starts[b] += starts[b - 1];
+        for (int i = 0; i < n; i++){
+            int at = starts[(key_from[i] >> shift) & ((1 << RADIX_BITS) - 1)]++;
+            key_to[at] = key_from[i];
+            to[at] = from[i];
+        }
+        uint32_t *key_swap = key_from;
+        key_from = key_to;
+        key_to = key_swap;
+        StudentRecord **swap = from;
+        from = to;
+        to = swap;
+    }
+    if (from != sorted) memcpy(sorted, from, n * sizeof(StudentRecord *));
+    free(keys);
     return 0;
 }
-int sortmarkDESC(const void* a, const void* b) {
-    const StudentRecord* studentA = *(const StudentRecord**)a;
-    const StudentRecord* studentB = *(const StudentRecord**)b;
-    if (studentA->mark > studentB->mark) return -1;
-    if (studentA->mark < studentB->mark) return 1;
+
+/*
+ * Put records, given in id order with their marks alongside, into markKey order in sorted. Returns 1 if out of memory.
+ * Marks at 0.1 precision, which is all a file or the prompt normally gives, take one counting pass over tenths,
+ * stable so ties stay in id order. Any finer mark sends the whole lot to radixSortByMark.
+ */
+int sortByMark(StudentRecord **records, const float *marks, int n, StudentRecord **sorted){
+    int starts[MARK_TENTHS + 1] = {0};
+    for (int i = 0; i < n; i++){
+        int tenths = (int)(marks[i] * 10.0f + 0.5f);
+        if ((float)tenths / 10.0f != marks[i]) return radixSortByMark(records, marks, n, sorted);
+        starts[tenths + 1]++;
+    }
+    for (int t = 1; t <= MARK_TENTHS; t++) starts[t] += starts[t - 1];
+    for (int i = 0; i < n; i++){
+        sorted[starts[(int)(marks[i] * 10.0f + 0.5f)]++] = records[i];
+    }
     return 0;
 }
 
 
 /* Helper Functions*/
 void collectRecords(BTreeNode *root, StudentRecord **studentRecordsArr, int *num_students){
-    
+    // Fills studentRecordsArr in ascending ID order, num_students is the next free index
     if (root != NULL){
         int i;
         for (i = 0; i < root->num_keys; i++) {
             collectRecords(root->children[i],studentRecordsArr, num_students);       // left child
-            *num_students -= 1;
             studentRecordsArr[*num_students] = root->keys[i];          // store pointer
+            *num_students += 1;
 
         }
         collectRecords(root->children[i], studentRecordsArr, num_students);           // last child
     }
 }
 
+/* Records in the whole tree */
+int treeSize(BTreeNode *root){
+    return root ? root->count : 0;
+}
+
+/* Records under children[i] of node */
+int childCount(BTreeNode *node, int i){
+    return node->is_leaf ? 0 : node->children[i]->count;
+}
+
+/* Index of the first key in node that is >= key, or num_keys if every key is smaller */
+int findKey(BTreeNode *node, BTreeKey key){
+    int low = 0;
+    int high = node->num_keys;
+    while (low < high){
+        int mid = (low + high) / 2;
+        if (node->sort_keys[mid] < key){
+            low = mid + 1;
+        }
+        else{
+            high = mid;
+        }
+    }
+    return low;
+}
+
+/* Store rec at position i of node under the given key */
+void setKey(BTreeNode *node, int i, BTreeKey key, StudentRecord *rec){
+    node->keys[i] = rec;
+    node->sort_keys[i] = key;
+}
+
+/* Copy position j of src to position i of dst, the sort key comes along without looking at the record */
+void moveKey(BTreeNode *dst, int i, BTreeNode *src, int j){
+    dst->keys[i] = src->keys[j];
+    dst->sort_keys[i] = src->sort_keys[j];
+}
+
+void clearKey(BTreeNode *node, int i){
+    setKey(node, i, 0, NULL);
+}
+
+/* ========== Concurrent readers ========== */
+
+/*
+ * Optimistic lock coupling. Writers take tree_write_lock, so one runs at a time, and turn a node's
+ * version odd while they change its keys or children and even again after. Readers never lock:
+ * they note each node's version on the way down and check it again before trusting what they read,
+ * starting over from the root if it moved. Records carry the same kind of version for their fields.
+ * Counts are not covered, an insert bumps every count on its path and that would restart every reader.
+ * OPEN and the teardown at exit throw the whole database away and must not run alongside readers.
+ * The readers are the server's QUERY ID= threads, database --stress in a -DBENCHMARK build puts them under load.
+ */
+#ifndef NO_THREADS
+pthread_mutex_t tree_write_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+void treeWriteBegin(){
+#ifndef NO_THREADS
+    pthread_mutex_lock(&tree_write_lock);
+#endif
+}
+
+void treeWriteEnd(){
+#ifndef NO_THREADS
+    pthread_mutex_unlock(&tree_write_lock);
+#endif
+}
+
+/* Only called with tree_write_lock held, so there is never another writer to race for the version */
+void versionLock(uint32_t *version){
+    __atomic_store_n(version, *version + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE); // Readers must see the odd version before any change
+}
+
+void versionUnlock(uint32_t *version){
+    __atomic_store_n(version, *version + 1, __ATOMIC_RELEASE);
+}
+
+/* One more round of waiting on a writer. After a short spin the reader gives up its CPU, the writer may need it to finish */
+void spinPause(int *spins){
+    if (++*spins < 64){
+#if defined(__AVX2__) || defined(__SSE2__)
+        _mm_pause();
+#endif
+        return;
+    }
+#ifdef _WIN32
+    SwitchToThread();
+#else
+    sched_yield();
+#endif
+}
+
+/* Version to check the reads against, waits out a writer that is part way through */
+uint32_t versionRead(uint32_t *version){
+    uint32_t seen;
+    int spins = 0;
+    while ((seen = __atomic_load_n(version, __ATOMIC_ACQUIRE)) & 1) spinPause(&spins);
+    return seen;
+}
+
+/* Nothing read since versionRead returned seen was changed under the reader */
+bool versionValid(uint32_t *version, uint32_t seen){
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(version, __ATOMIC_RELAXED) == seen;
+}
+
+/*
+ * Copy rec into copy, false if a writer got in the way. The name is only copied once the pointer and length
+ * are known to belong together, a name slot freed since is still at least that long so the read stays in bounds.
+ */
+bool copyRecord(StudentRecord *rec, RecordCopy *copy){
+    uint32_t seen = versionRead(&rec->version);
+    copy->rec = *rec;
+    if (!versionValid(&rec->version, seen)) return false;
+    memcpy(copy->name, copy->rec.name, copy->rec.name_len);
+    copy->name[copy->rec.name_len] = '\0';
+    copy->rec.name = copy->name;
+    return versionValid(&rec->version, seen);
+}
+
 StudentRecord* searchIndex(BTreeNode *root,int search_index){
-    if (root){
-        int nth_child;//determines which child we continue looking in depending on where we get a value where our search key is less than our node key
-        for (nth_child = 0; nth_child < root->num_keys;nth_child++){
-            if (root->keys[nth_child]->id == search_index){
-                StudentRecord* p_record = root->keys[nth_child];
-                return p_record;
-            }
-            else if (search_index < root->keys[nth_child]->id){
-                break;
-            }
+    STAT(counters.searches++);
+    while (root){
+        STAT(counters.nodes_visited++);
+        int nth_child = findKey(root, search_index);//determines which child we continue looking in, the first key that is not less than our search key
+        if (nth_child < root->num_keys && root->sort_keys[nth_child] == (BTreeKey)search_index){
+            return root->keys[nth_child];
+        }
+        root = root->is_leaf ? NULL : root->children[nth_child];
+    }
+    return NULL;
+}
+
+/*
+ * One optimistic descent, 1 if found, 0 if not, -1 if a writer got in the way and it has to start over.
+ * Nodes looked at are added to *visited, the caller owns it so readers on other threads never share a counter.
+ */
+int searchAttempt(BTreeNode **rootRef, BTreeKey key, RecordCopy *copy, unsigned long long *visited){
+    BTreeNode *node = __atomic_load_n(rootRef, __ATOMIC_ACQUIRE);
+    if (node == NULL) return 0;
+    uint32_t seen = versionRead(&node->version);
+    if (__atomic_load_n(rootRef, __ATOMIC_ACQUIRE) != node) return -1; // The root split or shrank first
+
+    while (1){
+        (*visited)++;
+        // A node freed under us can hold anything, keep the search inside the arrays until it fails validation
+        int num_keys = node->num_keys;
+        if (num_keys < 0 || num_keys > MAX_KEYS) return -1;
+        int low = 0;
+        int high = num_keys;
+        while (low < high){
+            int mid = (low + high) / 2;
+            if (node->sort_keys[mid] < key) low = mid + 1;
+            else high = mid;
+        }
+        if (low < num_keys && node->sort_keys[low] == key){
+            StudentRecord *rec = node->keys[low];
+            if (!versionValid(&node->version, seen)) return -1;
+            // Still in this node after the copy, so it was not freed part way through
+            if (!copyRecord(rec, copy) || !versionValid(&node->version, seen)) return -1;
+            return 1;
+        }
+        if (node->is_leaf){
+            return versionValid(&node->version, seen) ? 0 : -1;
         }
-        searchIndex(root->children[nth_child], search_index);
+        BTreeNode *child = node->children[low];
+        if (!versionValid(&node->version, seen) || child == NULL) return -1;
+        uint32_t child_seen = versionRead(&child->version);
+        if (!versionValid(&node->version, seen)) return -1; // child may have been merged away before we read its version
+        node = child;
+        seen = child_seen;
+    }
+}
 
+/*
+ * searchIndex for a reader running alongside writers. The record is copied out, a writer may change
+ * or free it the moment the search is over. Returns 1 if the id was found.
+ * Leaves the counters alone, the thread that owns them adds the search and *visited.
+ */
+int searchIndexShared(BTreeNode **rootRef, int id, RecordCopy *copy, unsigned long long *visited){
+    int found;
+    int spins = 0;
+    while ((found = searchAttempt(rootRef, (BTreeKey)id, copy, visited)) < 0) spinPause(&spins);
+    return found;
+}
+
+/* First record filed under a key >= key, NULL if every key is smaller */
+StudentRecord *lowerBound(BTreeNode *root, BTreeKey key){
+    StudentRecord *found = NULL;
+    while (root){
+        int i = findKey(root, key);
+        if (i < root->num_keys){
+            found = root->keys[i]; // Best so far, a smaller candidate can only sit in children[i]
+            if (root->sort_keys[i] == key) break;
+        }
+        root = root->is_leaf ? NULL : root->children[i];
+    }
+    return found;
+}
+
+/* Number of keys in the tree smaller than key, children wholly below it are counted without going into them */
+int countBelow(BTreeNode *root, BTreeKey key){
+    int below = 0;
+    while (root){
+        int i = findKey(root, key);
+        for (int j = 0; j < i; j++){
+            below += childCount(root, j) + 1;
+        }
+        if (i < root->num_keys && root->sort_keys[i] == key){
+            return below + childCount(root, i);
+        }
+        root = root->is_leaf ? NULL : root->children[i];
+    }
+    return below;
+}
+
+/* Record with the largest key, NULL for an empty tree */
+StudentRecord *lastRecord(BTreeNode *root){
+    if (root == NULL) return NULL;
+    while (!root->is_leaf) root = root->children[root->num_keys];
+    return root->keys[root->num_keys - 1];
+}
+
+/* ========== Cursor ========== */
+
+/*
+ * Walks a tree in key order without recursion, the path from the root is kept on an explicit stack.
+ * pos[d] is the key of nodes[d] the cursor is at, or for the nodes above the current one, the child it went down.
+ * Either way the next key of that node in order is keys[pos[d]], which is what lets the cursor climb back up.
+ */
+#define CURSOR_MAX_DEPTH 32 // A tree with MIN_DEGREE 2 and 2^31 records is at most 31 levels deep
+
+typedef struct Cursor {
+    BTreeNode *nodes[CURSOR_MAX_DEPTH];
+    int pos[CURSOR_MAX_DEPTH];
+    int depth; // Number of entries on the stack, 0 once the cursor has run off the end
+} Cursor;
+
+/* Pop finished nodes until the top of the stack points at a key again */
+void cursorSettle(Cursor *cursor){
+    while (cursor->depth > 0 && cursor->pos[cursor->depth - 1] >= cursor->nodes[cursor->depth - 1]->num_keys){
+        cursor->depth--;
+    }
+}
+
+/* Put the cursor on the first key >= key */
+void cursorSeek(Cursor *cursor, BTreeNode *root, BTreeKey key){
+    cursor->depth = 0;
+    while (root){
+        int i = findKey(root, key);
+        cursor->nodes[cursor->depth] = root;
+        cursor->pos[cursor->depth] = i;
+        cursor->depth++;
+        if (i < root->num_keys && root->sort_keys[i] == key) break;
+        root = root->is_leaf ? NULL : root->children[i];
+    }
+    cursorSettle(cursor);
+}
+
+/* Record under the cursor, NULL past the end */
+StudentRecord *cursorRecord(Cursor *cursor){
+    if (cursor->depth == 0) return NULL;
+    return cursor->nodes[cursor->depth - 1]->keys[cursor->pos[cursor->depth - 1]];
+}
+
+BTreeKey cursorKey(Cursor *cursor){
+    return cursor->nodes[cursor->depth - 1]->sort_keys[cursor->pos[cursor->depth - 1]];
+}
+
+/* Step to the next key in order */
+void cursorNext(Cursor *cursor){
+    if (cursor->depth == 0) return;
+    BTreeNode *node = cursor->nodes[cursor->depth - 1];
+    int i = ++cursor->pos[cursor->depth - 1];
+    // After keys[i - 1] comes the leftmost key under children[i]
+    while (!node->is_leaf){
+        node = node->children[i];
+        i = 0;
+        cursor->nodes[cursor->depth] = node;
+        cursor->pos[cursor->depth] = 0;
+        cursor->depth++;
+    }
+    cursorSettle(cursor);
+}
+
+/* Step to the previous key in order, running off the front leaves the cursor past the end like cursorNext does */
+void cursorPrev(Cursor *cursor){
+    if (cursor->depth == 0) return;
+    BTreeNode *node = cursor->nodes[cursor->depth - 1];
+    if (!node->is_leaf){
+        // Before keys[i] comes the rightmost key under children[i], the entry for node stays as the child taken
+        node = node->children[cursor->pos[cursor->depth - 1]];
+        while (!node->is_leaf){
+            cursor->nodes[cursor->depth] = node;
+            cursor->pos[cursor->depth] = node->num_keys;
+            cursor->depth++;
+            node = node->children[node->num_keys];
+        }
+        cursor->nodes[cursor->depth] = node;
+        cursor->pos[cursor->depth] = node->num_keys - 1;
+        cursor->depth++;
+        return;
+    }
+    cursor->pos[cursor->depth - 1]--;
+    // Climbing out of children[j] lands on keys[j - 1]
+    while (cursor->depth > 0 && cursor->pos[cursor->depth - 1] < 0){
+        cursor->depth--;
+        if (cursor->depth > 0) cursor->pos[cursor->depth - 1]--;
+    }
+}
+
+/* Put the cursor on the record with the given rank in key order, 0 being the first */
+void cursorSeekRank(Cursor *cursor, BTreeNode *root, int rank){
+    cursor->depth = 0;
+    if (root == NULL || rank < 0 || rank >= root->count) return;
+    while (1){
+        // Skip each child that ends before rank, and the key after it, without going into it
+        int i = 0;
+        while (rank > childCount(root, i)){
+            rank -= childCount(root, i) + 1;
+            i++;
+        }
+        cursor->nodes[cursor->depth] = root;
+        cursor->pos[cursor->depth] = i;
+        cursor->depth++;
+        if (rank == childCount(root, i)) return; // It is keys[i]
+        root = root->children[i];
     }
-    
 }
 
 /* B Tree Implementation*/
 // Function to create a new node
 BTreeNode *createNode(bool is_leaf) {
-    BTreeNode *newNode = (struct BTreeNode *)malloc(sizeof(BTreeNode));
-    if (newNode == NULL) {
-        perror("Memory allocation failed");
-        exit(EXIT_FAILURE);
-    }
+    BTreeNode *newNode = poolAlloc(&node_pool);
+    versionLock(&newNode->version); // A reader may still hold it from before it was freed
     newNode->num_keys = 0;
     newNode->is_leaf = is_leaf;
+    newNode->count = 0;
     for (int i = 0; i < MAX_CHILDREN; i++) {
         newNode->children[i] = NULL;
     }
     for (int i = 0; i < MAX_KEYS; i++){
-        newNode->keys[i] = NULL;
+        clearKey(newNode, i);
     }
+    versionUnlock(&newNode->version);
     return newNode;
 }
 
+/* Free the nodes of a tree, leaving the records it points to alone */
+void freeNodes(BTreeNode *node) {
+    if (node == NULL) return;
+    if (!node->is_leaf) {
+        for (int i = 0; i <= node->num_keys; i++) {
+            freeNodes(node->children[i]);
+        }
+    }
+    poolFree(&node_pool, node);
+}
+
 // Function to split a full child node
 void splitChild(BTreeNode *parent, int index) {
+    STAT(counters.splits++);
     BTreeNode *child = parent->children[index];
     BTreeNode *newNode = createNode(child->is_leaf);
-    
+    versionLock(&parent->version);
+    versionLock(&child->version);
 
     newNode->num_keys = MIN_KEYS;
 
     // Move upper keys to new node
     for (int i = 0; i < MIN_KEYS; i++) {
-        newNode->keys[i] = child->keys[i + MIN_DEGREE];
-        child->keys[i + MIN_DEGREE] = NULL; // clear copied key
+        moveKey(newNode, i, child, i + MIN_DEGREE);
+        clearKey(child, i + MIN_DEGREE); // clear copied key
     }
 
     // Move children if not leaf
@@ -148,193 +921,303 @@ void splitChild(BTreeNode *parent, int index) {
 
     // Shift keys in parent
     for (int i = parent->num_keys; i > index; i--) {
-        parent->keys[i] = parent->keys[i - 1];
+        moveKey(parent, i, parent, i - 1);
     }
 
     // Insert median into parent
-    parent->keys[index] = child->keys[MIN_DEGREE - 1];
-    child->keys[MIN_DEGREE - 1] = NULL;
+    moveKey(parent, index, child, MIN_DEGREE - 1);
+    clearKey(child, MIN_DEGREE - 1);
 
     parent->num_keys++;
+
+    // The parent still holds the same records, the two halves split the child's
+    newNode->count = MIN_KEYS;
+    for (int i = 0; i <= MIN_KEYS; i++) {
+        newNode->count += childCount(newNode, i);
+    }
+    child->count -= newNode->count + 1;
+    versionUnlock(&child->version);
+    versionUnlock(&parent->version);
 }
 
 
 // Function to insert a key into a non-full node
-void insertNonFull(BTreeNode *node, StudentRecord* rec) {
-    int i = node->num_keys - 1;
+void insertNonFull(BTreeNode *node, BTreeKey key, StudentRecord* rec) {
+    // Position of the first key greater than the new one
+    int i = findKey(node, key);
+    node->count++;
     
     if (node->is_leaf) {
         // Insert key into the sorted order
-        while (i >= 0 && node->keys[i]->id > rec->id) {
-            node->keys[i + 1] = node->keys[i];
-            i--;
-        }
-        node->keys[i + 1] = rec;
+        int to_move = node->num_keys - i;
+        versionLock(&node->version);
+        memmove(&node->sort_keys[i + 1], &node->sort_keys[i], to_move * sizeof(node->sort_keys[0]));
+        memmove(&node->keys[i + 1], &node->keys[i], to_move * sizeof(node->keys[0]));
+        setKey(node, i, key, rec);
         node->num_keys++;
+        versionUnlock(&node->version);
     } else {
         // Find the child to insert the key
-        while (i >= 0 && node->keys[i]->id > rec->id) {
-            i--;
-        }
-        i++;
-        
         if (node->children[i]->num_keys == MAX_KEYS) {
             // Split child if it's full
             splitChild(node, i);
             
             // Determine which of the two children is the new one
-            if (node->keys[i]->id < rec->id) {
+            if (node->sort_keys[i] < key) {
                 i++;
             }
         }
-        insertNonFull(node->children[i], rec);
+        insertNonFull(node->children[i], key, rec);
     }
 }
 
-// Function to insert a key into the B-tree
-void insert(BTreeNode **root, StudentRecord *key) {
+// Function to insert rec into the B-tree under key
+void insert(BTreeNode **root, BTreeKey key, StudentRecord *rec) {
     BTreeNode *node = *root;
 
     if (node == NULL) {
-        // Create a new root node
-        *root = createNode(true);
-        (*root)->keys[0] = key;
-        (*root)->num_keys = 1;
+        // Create a new root node, readers only see it once it is filled in
+        node = createNode(true);
+        setKey(node, 0, key, rec);
+        node->num_keys = 1;
+        node->count = 1;
+        __atomic_store_n(root, node, __ATOMIC_RELEASE);
     } else {
         if (node->num_keys == MAX_KEYS) {
             // Split the root if it's full
             struct BTreeNode *new_root = createNode(false);
             new_root->children[0] = node;
+            new_root->count = node->count;
+            // Published before the split: a reader that finds the old root after that sees it has moved and starts over
+            __atomic_store_n(root, new_root, __ATOMIC_RELEASE);
             splitChild(new_root, 0);
-            *root = new_root;
         }
-        insertNonFull(*root, key);
+        insertNonFull(*root, key, rec);
     }
 }
 
-int checkTypeAndLen(char * str, int max_len){
-    for (int i = 0; str[i] != '\0'; i++){
-        if (!isalpha(str[i]) && str[i] != ' '){
+/* Same as checkTypeAndLen for a field that is not null terminated, max_len includes room for the terminator */
+/* Returns 1 for characters other than letters and spaces, 2 if the field is too long */
+int checkField(const char *str, size_t len, size_t max_len){
+    for (size_t i = 0; i < len; i++){
+        if (!isalpha((unsigned char)str[i]) && str[i] != ' '){
             return 1;
         }
     }
-    if (strlen(str) > max_len){
-        printf("Length too long\n");
-        return 1;
+    if (len >= max_len){
+        return 2;
     }
     return 0;
 }
 
-int createAndInsert(
-    BTreeNode **root,
-    int id,
-    char *name,
-    char *programme,
-    float mark,
-    int* num_students){
-    //Creates a studentrecord struct, and inserts it into the b tree
-    
-    if (searchIndex(*root, id) != NULL){
-        printf("The record with %s=%d already exists\n", ID, id);
-        return 1;
+int checkTypeAndLen(char * str, int max_len, OutBuffer *out){
+    int result = checkField(str, strlen(str), max_len);
+    if (result == 2){
+        outPrintf(out, "Length too long\n");
     }
-    else{
-        StudentRecord *newRec = malloc(sizeof(StudentRecord));
-        if (!newRec) {
-            printf("Memory allocation failed.\n");
-            return 1;
-        }
+    return result == 0 ? 0 : 1;
+}
 
-        if (checkTypeAndLen(name, MAX_NAME) == 1 || checkTypeAndLen(programme, MAX_PROGRAMME) == 1 || id < MIN_ID || id > MAX_ID || mark < MIN_MARK || mark > MAX_MARK){
-            return 1;
-        }
-        newRec->id = id;
-        
-        strncpy(newRec->name, name, sizeof(newRec->name)-1);
-        newRec->name[sizeof(newRec->name)-1] = '\0';
+/* Reason the fields can't make a valid record, NULL if they can */
+const char *recordError(int id, const char *name, size_t name_len, const char *programme, size_t programme_len, float mark){
+    if (id < MIN_ID || id > MAX_ID) return "Invalid ID!";
+    int name_check = checkField(name, name_len, MAX_NAME);
+    if (name_check != 0) return name_check == 2 ? "Length too long" : "Invalid data type for name!";
+    int programme_check = checkField(programme, programme_len, MAX_PROGRAMME);
+    if (programme_check != 0) return programme_check == 2 ? "Length too long" : "Invalid data type for programme!";
+    if (!(mark >= MIN_MARK && mark <= MAX_MARK)) return "Please enter a valid mark between 0-100";
+    return NULL;
+}
 
-        strncpy(newRec->programme, programme, sizeof(newRec->programme)-1);
-        newRec->programme[sizeof(newRec->programme)-1] = '\0';
+/* ========== Record text ========== */
+
+/*
+ * Programmes are interned: every distinct spelling gets a code the first time it is seen and keeps it,
+ * so records hold a two byte code and programme groups are found without touching the text.
+ * Codes are stored in chunks that never move, readers look a code up without taking the lock.
+ */
+#define PROGRAMME_CHUNK 256
+#define MAX_PROGRAMME_CODES 65536
+#define PROGRAMME_SLOTS_MIN 64
+
+typedef struct ProgrammeName {
+    char *text;
+    uint32_t hash; // Of the exact spelling
+    struct ProgrammeGroup *group; // Where records with this spelling are grouped, NULL until one is
+} ProgrammeName;
+
+typedef struct ProgrammeDictionary {
+    ProgrammeName *chunks[MAX_PROGRAMME_CODES / PROGRAMME_CHUNK];
+    uint32_t *slots; // Open addressing on the spelling, code + 1, 0 when empty
+    int num_slots; // Always a power of two, at least twice num_codes
+    int num_codes;
+} ProgrammeDictionary;
+
+ProgrammeDictionary programme_dictionary = {{NULL}, NULL, 0, 0};
+#ifndef NO_THREADS
+pthread_mutex_t programme_lock = PTHREAD_MUTEX_INITIALIZER; // Parse workers intern in parallel
+#endif
+
+ProgrammeName *programmeName(uint16_t code){
+    return &programme_dictionary.chunks[code / PROGRAMME_CHUNK][code % PROGRAMME_CHUNK];
+}
 
-        newRec->mark = mark;
-        insert(root, newRec);
-        printf("ID %d successfully inserted\n", id);
-        *num_students += 1;
+const char *programmeText(uint16_t code){
+    return programmeName(code)->text;
+}
 
-        return 0;
+uint32_t spellingHash(const char *text, size_t len){
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++){
+        hash = (hash ^ (unsigned char)text[i]) * 16777619u;
     }
+    return hash;
+}
 
+void programmeRehash(){
+    ProgrammeDictionary *dict = &programme_dictionary;
+    int num_slots = dict->num_slots ? dict->num_slots * 2 : PROGRAMME_SLOTS_MIN;
+    uint32_t *slots = calloc(num_slots, sizeof(uint32_t));
+    if (slots == NULL){
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    for (int code = 0; code < dict->num_codes; code++){
+        uint32_t i = programmeName(code)->hash & (num_slots - 1);
+        while (slots[i] != 0) i = (i + 1) & (num_slots - 1);
+        slots[i] = code + 1;
+    }
+    free(dict->slots);
+    dict->slots = slots;
+    dict->num_slots = num_slots;
 }
 
-void updateStudentRecord(BTreeNode *root, int search_index,char *field, char *value){
-    StudentRecord * p_record = searchIndex(root, search_index);
-    if (p_record){
-        if (strcmp(field, "mark") == 0) {
-            char *endptr;
-            float f = strtof(value, &endptr);
-            if (*endptr == '\0'){
-                if (f < 0 || f > 100){
-                    printf("Please enter a valid mark between 0-100");
-                    return;
-                }
-                p_record->mark = f;
-            }
-            else{
-                printf("Invalid data type! Must be type float!\n");
-                return;
-            }
+/* Code for the spelling text[0..len-1], which does not need to be null terminated */
+uint16_t programmeIntern(const char *text, size_t len){
+    ProgrammeDictionary *dict = &programme_dictionary;
+    uint32_t hash = spellingHash(text, len);
+#ifndef NO_THREADS
+    pthread_mutex_lock(&programme_lock);
+#endif
+    if (dict->num_codes * 2 >= dict->num_slots) programmeRehash();
+    uint32_t i = hash & (dict->num_slots - 1);
+    while (dict->slots[i] != 0){
+        ProgrammeName *entry = programmeName(dict->slots[i] - 1);
+        if (entry->hash == hash && strncmp(entry->text, text, len) == 0 && entry->text[len] == '\0') break;
+        i = (i + 1) & (dict->num_slots - 1);
+    }
+    if (dict->slots[i] == 0){
+        if (dict->num_codes == MAX_PROGRAMME_CODES){
+            printf("Too many different programmes.\n");
+            exit(EXIT_FAILURE);
         }
-        // if field is 'name', update the name
-        else if (strcmp(field, "name") == 0) {
-            if (checkTypeAndLen(value, MAX_NAME) == 1){
-                printf("Invalid data type for name!\n");
-                return;
-            }
-            strcpy(p_record->name, value);
-            printf("The record with ID=%d is successfully updated.\n", search_index);
-
+        int code = dict->num_codes;
+        if (code % PROGRAMME_CHUNK == 0){
+            dict->chunks[code / PROGRAMME_CHUNK] = calloc(PROGRAMME_CHUNK, sizeof(ProgrammeName));
         }
-        // if field is 'programme', update the programme
-        else if (strcmp(field, "programme") == 0) {
-            if (checkTypeAndLen(value, MAX_PROGRAMME) == 1){
-                printf("Invalid data type for programme!\n");
-                return;
-            }
-            strcpy(p_record->programme, value);
-            printf("The record with ID=%d is successfully updated.\n", search_index);
+        char *copy = malloc(len + 1);
+        if (dict->chunks[code / PROGRAMME_CHUNK] == NULL || copy == NULL){
+            perror("Memory allocation failed");
+            exit(EXIT_FAILURE);
         }
+        memcpy(copy, text, len);
+        copy[len] = '\0';
+        ProgrammeName *entry = programmeName(code);
+        entry->text = copy;
+        entry->hash = hash;
+        entry->group = NULL;
+        dict->slots[i] = code + 1;
+        dict->num_codes++;
     }
-    else{
-        printf("Record with ID=%d not found!\n", search_index);
+    uint16_t code = dict->slots[i] - 1;
+#ifndef NO_THREADS
+    pthread_mutex_unlock(&programme_lock);
+#endif
+    return code;
+}
+
+#define PROGRAMME_CACHE_SIZE 64 // Power of two, a file rarely has more programme spellings than this
+
+/* Spellings a loader has interned lately, so most records get their code without taking programme_lock */
+typedef struct ProgrammeCache {
+    uint32_t hash[PROGRAMME_CACHE_SIZE];
+    uint16_t code[PROGRAMME_CACHE_SIZE]; // code + 1, 0 when empty
+} ProgrammeCache;
+
+/* programmeIntern through cache, only a spelling the cache has not seen goes to the dictionary */
+uint16_t programmeCached(ProgrammeCache *cache, const char *text, size_t len){
+    uint32_t hash = spellingHash(text, len);
+    int i = hash & (PROGRAMME_CACHE_SIZE - 1);
+    if (cache->code[i] != 0 && cache->hash[i] == hash){
+        // Codes never move and the entry was filled before this loader was handed its code
+        const char *known = programmeText(cache->code[i] - 1);
+        if (strncmp(known, text, len) == 0 && known[len] == '\0') return cache->code[i] - 1;
     }
+    uint16_t code = programmeIntern(text, len);
+    cache->hash[i] = hash;
+    cache->code[i] = code + 1;
+    return code;
+}
+
+/* Size class in name_heap for a name of len characters plus its terminator */
+int nameClass(size_t len){
+    int c = 0;
+    while ((size_t)16 << c <= len) c++;
+    return c;
+}
 
+/* Copy name[0..len-1] into a slot of heap, an array of NAME_CLASSES pools */
+char *nameStore(Pool *heap, const char *name, size_t len){
+    char *stored = poolAlloc(&heap[nameClass(len)]);
+    memcpy(stored, name, len);
+    stored[len] = '\0';
+    return stored;
 }
 
+StudentRecord *createRecord(Pool *pool, Pool *names, int id, const char *name, size_t name_len, uint16_t programme, float mark){
+    //Creates a studentrecord struct from fields already checked by recordError, its name goes into names
+    //The name is copied by length, so it can point straight into a file buffer. programme is already interned
+    StudentRecord *newRec = poolAlloc(pool);
+    versionLock(&newRec->version);
+    newRec->id = id;
+
+    newRec->name = nameStore(names, name, name_len);
+    newRec->name_len = (uint8_t)name_len;
+    newRec->programme = programme;
+
+    newRec->mark = mark;
+    versionUnlock(&newRec->version);
+    return newRec;
+}
 
 /* ========== Deletion helpers ========== */
 
-/* Get predecessor: go to child[idx] and then while not leaf go to last child */
-StudentRecord *getPredecessor(BTreeNode *node, int idx) {
+/* Get predecessor: go to child[idx] and then while not leaf go to last child, the predecessor is that leaf's last key */
+BTreeNode *getPredecessor(BTreeNode *node, int idx) {
     BTreeNode *cur = node->children[idx];
     while (!cur->is_leaf) cur = cur->children[cur->num_keys];
-    return cur->keys[cur->num_keys - 1];
+    return cur;
 }
 
-/* Get successor: go to child[idx+1], then to leftmost key */
-StudentRecord *getSuccessor(BTreeNode *node, int idx) {
+/* Get successor: go to child[idx+1], then down the leftmost children, the successor is that leaf's first key */
+BTreeNode *getSuccessor(BTreeNode *node, int idx) {
     BTreeNode *cur = node->children[idx + 1];
     while (!cur->is_leaf) cur = cur->children[0];
-    return cur->keys[0];
+    return cur;
 }
 
 /* Borrow from previous sibling (idx-1) into child idx */
 void borrowFromPrev(BTreeNode *node, int idx) {
+    STAT(counters.borrows++);
     BTreeNode *child = node->children[idx];
     BTreeNode *sibling = node->children[idx - 1];
+    versionLock(&node->version);
+    versionLock(&child->version);
+    versionLock(&sibling->version);
 
     // shift child's keys and children right by 1
     for (int i = child->num_keys - 1; i >= 0; i--) {
-        child->keys[i + 1] = child->keys[i];
+        moveKey(child, i + 1, child, i);
     }
     if (!child->is_leaf) {
         for (int i = child->num_keys; i >= 0; i--) {
@@ -343,7 +1226,7 @@ void borrowFromPrev(BTreeNode *node, int idx) {
     }
 
     // bring key from parent down to child
-    child->keys[0] = node->keys[idx - 1];
+    moveKey(child, 0, node, idx - 1);
 
     if (!child->is_leaf) {
         child->children[0] = sibling->children[sibling->num_keys];
@@ -351,20 +1234,31 @@ void borrowFromPrev(BTreeNode *node, int idx) {
     }
 
     // move sibling's last key up to parent
-    node->keys[idx - 1] = sibling->keys[sibling->num_keys - 1];
-    sibling->keys[sibling->num_keys - 1] = NULL;
+    moveKey(node, idx - 1, sibling, sibling->num_keys - 1);
+    clearKey(sibling, sibling->num_keys - 1);
 
     child->num_keys += 1;
     sibling->num_keys -= 1;
+
+    int moved = 1 + childCount(child, 0);
+    child->count += moved;
+    sibling->count -= moved;
+    versionUnlock(&sibling->version);
+    versionUnlock(&child->version);
+    versionUnlock(&node->version);
 }
 
 /* Borrow from next sibling (idx+1) into child idx */
 void borrowFromNext(BTreeNode *node, int idx) {
+    STAT(counters.borrows++);
     BTreeNode *child = node->children[idx];
     BTreeNode *sibling = node->children[idx + 1];
+    versionLock(&node->version);
+    versionLock(&child->version);
+    versionLock(&sibling->version);
 
     // parent key goes to child's last position
-    child->keys[child->num_keys] = node->keys[idx];
+    moveKey(child, child->num_keys, node, idx);
 
     if (!child->is_leaf) {
         child->children[child->num_keys + 1] = sibling->children[0];
@@ -376,30 +1270,41 @@ void borrowFromNext(BTreeNode *node, int idx) {
     }
 
     // move sibling's first key up to parent
-    node->keys[idx] = sibling->keys[0];
+    moveKey(node, idx, sibling, 0);
 
     // shift sibling's keys left
     for (int i = 0; i < sibling->num_keys - 1; i++) {
-        sibling->keys[i] = sibling->keys[i + 1];
+        moveKey(sibling, i, sibling, i + 1);
     }
-    sibling->keys[sibling->num_keys - 1] = NULL;
+    clearKey(sibling, sibling->num_keys - 1);
 
     child->num_keys += 1;
     sibling->num_keys -= 1;
+
+    int moved = 1 + childCount(child, child->num_keys);
+    child->count += moved;
+    sibling->count -= moved;
+    versionUnlock(&sibling->version);
+    versionUnlock(&child->version);
+    versionUnlock(&node->version);
 }
 
 /* Merge child[idx] with child[idx+1]. The key at parent[idx] moves down. */
 void mergeChild(BTreeNode *node, int idx) {
+    STAT(counters.merges++);
     BTreeNode *child = node->children[idx];
     BTreeNode *sibling = node->children[idx + 1];
+    versionLock(&node->version);
+    versionLock(&child->version);
+    versionLock(&sibling->version);
 
     // Pull the key from parent down into child
-    child->keys[MIN_KEYS] = node->keys[idx];
+    moveKey(child, MIN_KEYS, node, idx);
 
     // Copy keys from sibling to child
     for (int i = 0; i < sibling->num_keys; i++) {
-        child->keys[i + MIN_DEGREE] = sibling->keys[i];
-        sibling->keys[i] = NULL;
+        moveKey(child, i + MIN_DEGREE, sibling, i);
+        clearKey(sibling, i);
     }
 
     // Copy children pointers
@@ -412,9 +1317,9 @@ void mergeChild(BTreeNode *node, int idx) {
 
     // shift keys in parent to fill the gap
     for (int i = idx + 1; i < node->num_keys; i++) {
-        node->keys[i - 1] = node->keys[i];
+        moveKey(node, i - 1, node, i);
     }
-    node->keys[node->num_keys - 1] = NULL;
+    clearKey(node, node->num_keys - 1);
 
     // shift children in parent
     for (int i = idx + 2; i <= node->num_keys; i++) {
@@ -423,24 +1328,25 @@ void mergeChild(BTreeNode *node, int idx) {
     node->children[node->num_keys] = NULL;
 
     child->num_keys += sibling->num_keys + 1;
+    child->count += sibling->count + 1;
     node->num_keys--;
+    versionUnlock(&sibling->version); // Readers still on it fail validation, it is no longer reachable
+    versionUnlock(&child->version);
+    versionUnlock(&node->version);
 
     // free sibling node
-    free(sibling);
+    poolFree(&node_pool, sibling);
 }
 
-/* Remove a key present in a leaf node at index idx */
+/* Remove a key present in a leaf node at index idx, the record itself is left to the caller */
 void removeFromLeaf(BTreeNode *node, int idx) {
-    // free the StudentRecord memory 
-    if (node->keys[idx]) {
-        free(node->keys[idx]);
-        node->keys[idx] = NULL;
-    }
-    for (int i = idx + 1; i < node->num_keys; i++) {
-        node->keys[i - 1] = node->keys[i];
-    }
-    node->keys[node->num_keys - 1] = NULL;
+    int to_move = node->num_keys - idx - 1;
+    versionLock(&node->version);
+    memmove(&node->sort_keys[idx], &node->sort_keys[idx + 1], to_move * sizeof(node->sort_keys[0]));
+    memmove(&node->keys[idx], &node->keys[idx + 1], to_move * sizeof(node->keys[0]));
+    clearKey(node, node->num_keys - 1);
     node->num_keys--;
+    versionUnlock(&node->version);
 }
 
 /* fill ensures that child[idx] has at least t keys by borrowing or merging */
@@ -458,14 +1364,16 @@ void fill(BTreeNode *node, int idx) {
     }
 }
 
-/* The main recursive removal routine: remove key with id from subtree rooted at node */
-int removeKey(BTreeNode *node, int id, int* num_students) {
-    int idx = 0;
-    while (idx < node->num_keys && node->keys[idx]->id < id) idx++;
+/*
+ * The main recursive removal routine: remove key from subtree rooted at node.
+ * Returns the record that was unlinked from the tree (NULL if key was not found), the caller frees it.
+ */
+StudentRecord *removeKey(BTreeNode *node, BTreeKey key) {
+    int idx = findKey(node, key);
 
     // Case 1: key is present in this node
-    if (idx < node->num_keys && node->keys[idx]->id == id) {
-        *num_students -= 1; // Since key is successfully found, it will be removed ,and thus num of students will decrease by 1
+    if (idx < node->num_keys && node->sort_keys[idx] == key) {
+        StudentRecord *removed = node->keys[idx];
         if (node->is_leaf) {
             // found in leaf
             removeFromLeaf(node, idx);
@@ -474,44 +1382,36 @@ int removeKey(BTreeNode *node, int id, int* num_students) {
             // found in internal node
             // Handle using predecessor/successor/merge approach
             if (node->children[idx]->num_keys >= MIN_DEGREE) {
-               StudentRecord *pred = getPredecessor(node, idx);
+                BTreeNode *pred = getPredecessor(node, idx);
 
-                // copy pred content into node->keys[idx]
-                StudentRecord *copy = malloc(sizeof(StudentRecord));
-                if (!copy) { 
-                    perror("malloc"); exit(EXIT_FAILURE); 
-                }
-                *copy = *pred;
-                free(node->keys[idx]);
-                node->keys[idx] = copy;
-
-                // recursively delete pred->id from children[idx]
-                removeKey(node->children[idx], pred->id, num_students);
+                // move pred up into node->keys[idx], then unlink it from the leaf it came from
+                versionLock(&node->version);
+                moveKey(node, idx, pred, pred->num_keys - 1);
+                versionUnlock(&node->version);
+                removeKey(node->children[idx], node->sort_keys[idx]);
             } 
             else if (node->children[idx + 1]->num_keys >= MIN_DEGREE) {
                 
-                StudentRecord *succ = getSuccessor(node, idx);
+                BTreeNode *succ = getSuccessor(node, idx);
 
-                StudentRecord *copy = malloc(sizeof(StudentRecord));
-                if (!copy) { perror("malloc"); exit(EXIT_FAILURE); }
-                *copy = *succ;
-                free(node->keys[idx]);
-                node->keys[idx] = copy;
-
-                removeKey(node->children[idx + 1], succ->id, num_students);
+                versionLock(&node->version);
+                moveKey(node, idx, succ, 0);
+                versionUnlock(&node->version);
+                removeKey(node->children[idx + 1], node->sort_keys[idx]);
 
             } else {
                 // merge and then recurse to the merged child
                 mergeChild(node, idx);
-                removeKey(node->children[idx], id, num_students);
+                removeKey(node->children[idx], key);
 
             }
         }
+        node->count--;
+        return removed;
     } else { // Case 2: key is not present in this node
         if (node->is_leaf) {
-            printf("ID %d not found in database!\n", id);
             // Key not present in tree
-            return 1;
+            return NULL;
         }
         // Determine if the child where the key may exist has at least t keys; if not, fill it
         bool flag = (idx == node->num_keys); // indicates if key is in last child
@@ -521,138 +1421,1162 @@ int removeKey(BTreeNode *node, int id, int* num_students) {
         }
 
         // If we merged, the index may have changed
+        StudentRecord *removed;
         if (flag && idx > node->num_keys) {
-            removeKey(node->children[idx - 1], id, num_students);
+            removed = removeKey(node->children[idx - 1], key);
         } else {
-            removeKey(node->children[idx], id, num_students);
+            removed = removeKey(node->children[idx], key);
         }
+        if (removed != NULL) node->count--;
+        return removed;
     }
 }
 
-/* Public wrapper to delete key id from tree rooted at *root */
-void deleteKey(BTreeNode **rootRef, int id, int*num_students) {
-    if (*rootRef == NULL) return;
-
-    if (removeKey(*rootRef, id, num_students) != 1){printf("ID %d deleted successfully\n", id);}
-    
+/* Unlink key from the tree rooted at *rootRef and shrink the tree if the root empties, returns the unlinked record */
+StudentRecord *removeFromTree(BTreeNode **rootRef, BTreeKey key) {
+    if (*rootRef == NULL) return NULL;
 
+    StudentRecord *removed = removeKey(*rootRef, key);
 
     // If root has 0 keys, make its first child the new root (if any)
     if ((*rootRef)->num_keys == 0) {
         BTreeNode *oldRoot = *rootRef;
-        if (oldRoot->is_leaf) {
-            // tree becomes empty
-            free(oldRoot);
-            *rootRef = NULL;
-        } else {
-            BTreeNode *newRoot = oldRoot->children[0];
-            free(oldRoot);
-            *rootRef = newRoot;
-        }
+        // The new root goes in before the old one is retired, readers still on the old one then start over
+        __atomic_store_n(rootRef, oldRoot->is_leaf ? NULL : oldRoot->children[0], __ATOMIC_RELEASE);
+        versionLock(&oldRoot->version);
+        versionUnlock(&oldRoot->version);
+        poolFree(&node_pool, oldRoot);
     }
+    return removed;
 }
 
-/*Printing Records*/
-void printRecord(StudentRecord *rec, FILE* file) {
-    //Have option to print as output, or print to file
-    if (file == NULL){
-        printf("%-10d %-15s %-25s %-5.1f\n",
-            rec->id,
-            rec->name,
-            rec->programme,
-            rec->mark
-        );
-    }
-    else{
-       fprintf(file, "%d,%s,%s,%.1f\n", rec->id, rec->name, rec->programme, rec->mark);
+/* ========== Programme index ========== */
+
+/*
+ * Hash table from programme name to a ProgrammeGroup, which holds that programme's records in a
+ * B tree by id along with its running aggregates. Names match ignoring case, so several spellings
+ * in the programme dictionary can share a group. Records find theirs through their code.
+ */
+#define PROGRAMME_BUCKETS_MIN 16
+
+typedef struct ProgrammeGroup {
+    const char *name; // As the first record of the group spelled it, text from the programme dictionary
+    uint32_t hash;
+    BTreeNode *members; // Records of this programme by id
+    int count;
+    double sum;
+    StudentRecord *lowest; // Ties go to the lowest id, same as SHOW SUMMARY
+    StudentRecord *highest;
+    struct ProgrammeGroup *next; // Next group in the same bucket
+} ProgrammeGroup;
+
+typedef struct ProgrammeIndex {
+    ProgrammeGroup **buckets;
+    int num_buckets; // Always a power of two
+    int num_groups;
+} ProgrammeIndex;
+
+ProgrammeIndex programme_index = {NULL, 0, 0};
+
+uint32_t programmeHash(const char *name){
+    uint32_t hash = 2166136261u;
+    for (; *name; name++){
+        hash = (hash ^ (unsigned char)tolower((unsigned char)*name)) * 16777619u;
     }
+    return hash;
 }
 
-void printHeader(){
-    printf("%-10s %-15s %-25s %-5s\n", 
-    ID, NAME, PROGRAMME, MARK);
+bool sameProgramme(const char *a, const char *b){
+    while (*a && tolower((unsigned char)*a) == tolower((unsigned char)*b)){
+        a++;
+        b++;
+    }
+    return tolower((unsigned char)*a) == tolower((unsigned char)*b);
 }
 
-/*Show ALl functions*/
-void traversal(BTreeNode *root, bool descending, float* summaryStatistics, FILE* file) {
-    if (root != NULL) {
-        int i;
-        // int start_index  = descending ? root->num_keys : 0;
-        // int end_index = descending ? 0 : root->num_keys ;
-        // int step = descending ? -1 : 1;
-
-        int start_index;
-        int end_index;
-        int step;
+/* Group for the given programme, NULL if no record has it */
+ProgrammeGroup *findProgramme(const char *name){
+    if (programme_index.num_groups == 0) return NULL;
+    uint32_t hash = programmeHash(name);
+    ProgrammeGroup *group = programme_index.buckets[hash & (programme_index.num_buckets - 1)];
+    while (group != NULL && !(group->hash == hash && sameProgramme(group->name, name))){
+        group = group->next;
+    }
+    return group;
+}
 
-        if (descending){
-            start_index = root->num_keys;
-            end_index = 0;
-            step = -1;
-        }
-        else{
-            start_index = 0;
-            end_index =  root->num_keys;
-            step = 1;
+/* Double the bucket array, groups are relinked without rehashing their names */
+void programmeGrow(){
+    int num_buckets = programme_index.num_buckets ? programme_index.num_buckets * 2 : PROGRAMME_BUCKETS_MIN;
+    ProgrammeGroup **buckets = calloc(num_buckets, sizeof(ProgrammeGroup *));
+    if (buckets == NULL){
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < programme_index.num_buckets; i++){
+        ProgrammeGroup *group = programme_index.buckets[i];
+        while (group != NULL){
+            ProgrammeGroup *next = group->next;
+            ProgrammeGroup **bucket = &buckets[group->hash & (num_buckets - 1)];
+            group->next = *bucket;
+            *bucket = group;
+            group = next;
         }
+    }
+    free(programme_index.buckets);
+    programme_index.buckets = buckets;
+    programme_index.num_buckets = num_buckets;
+}
 
-        
+/* a sits before b in the group extremes: lower mark for lowest, higher for highest, lower id on ties */
+bool beats(StudentRecord *a, StudentRecord *b, bool highest){
+    if (a->mark != b->mark) return highest ? a->mark > b->mark : a->mark < b->mark;
+    return a->id < b->id;
+}
 
-        for (i = start_index; i != end_index ; i += step) {
-            traversal(root->children[i], descending, summaryStatistics, file);
-            int key_to_index = descending ? i - 1 : i;
-            if (summaryStatistics == NULL) {
-                printRecord(root->keys[key_to_index], file);   
+void programmeAdd(StudentRecord *rec){
+    ProgrammeName *spelling = programmeName(rec->programme);
+    ProgrammeGroup *group = spelling->group;
+    if (group == NULL) group = findProgramme(spelling->text); // Another spelling may have the group already
+    if (group == NULL){
+        if (programme_index.num_groups >= programme_index.num_buckets) programmeGrow();
+        group = calloc(1, sizeof(ProgrammeGroup));
+        if (group == NULL){
+            perror("Memory allocation failed");
+            exit(EXIT_FAILURE);
+        }
+        group->name = spelling->text;
+        group->hash = programmeHash(spelling->text);
+        ProgrammeGroup **bucket = &programme_index.buckets[group->hash & (programme_index.num_buckets - 1)];
+        group->next = *bucket;
+        *bucket = group;
+        programme_index.num_groups++;
+    }
+    spelling->group = group;
+    insert(&group->members, (BTreeKey)rec->id, rec);
+    group->count++;
+    group->sum += rec->mark;
+    if (group->lowest == NULL || beats(rec, group->lowest, false)) group->lowest = rec;
+    if (group->highest == NULL || beats(rec, group->highest, true)) group->highest = rec;
+}
+
+/* Forget group in every spelling that pointed at it, NULL forgets every group */
+void programmeForget(ProgrammeGroup *group){
+    for (int code = 0; code < programme_dictionary.num_codes; code++){
+        ProgrammeName *spelling = programmeName(code);
+        if (group == NULL || spelling->group == group) spelling->group = NULL;
+    }
+}
+
+/* Find the group's lowest and highest marks again with a pass over its members */
+void programmeRescan(ProgrammeGroup *group){
+    group->lowest = NULL;
+    group->highest = NULL;
+    Cursor cursor;
+    for (cursorSeek(&cursor, group->members, 0); cursorRecord(&cursor) != NULL; cursorNext(&cursor)){
+        StudentRecord *member = cursorRecord(&cursor);
+        if (group->lowest == NULL || beats(member, group->lowest, false)) group->lowest = member;
+        if (group->highest == NULL || beats(member, group->highest, true)) group->highest = member;
+    }
+}
+
+void programmeRemove(StudentRecord *rec){
+    ProgrammeGroup *group = programmeName(rec->programme)->group;
+    if (group == NULL) return;
+    removeFromTree(&group->members, (BTreeKey)rec->id);
+    group->count--;
+    group->sum -= rec->mark;
+
+    if (group->count == 0){
+        // Last record of the programme, the group goes
+        ProgrammeGroup **link = &programme_index.buckets[group->hash & (programme_index.num_buckets - 1)];
+        while (*link != group) link = &(*link)->next;
+        *link = group->next;
+        programmeForget(group);
+        free(group);
+        programme_index.num_groups--;
+        return;
+    }
+    if (rec == group->lowest || rec == group->highest){
+        // Only losing an extreme costs a pass over the group
+        programmeRescan(group);
+    }
+}
+
+/* Called once rec's mark has changed from old, the record stays in its group and only the totals move */
+void programmeMarkChanged(StudentRecord *rec, float old){
+    ProgrammeGroup *group = programmeName(rec->programme)->group;
+    if (group == NULL) return;
+    group->sum += rec->mark - old;
+    if ((rec == group->lowest && rec->mark > old) || (rec == group->highest && rec->mark < old)){
+        // An extreme moved inwards, something else may have taken its place
+        programmeRescan(group);
+        return;
+    }
+    if (beats(rec, group->lowest, false)) group->lowest = rec;
+    if (beats(rec, group->highest, true)) group->highest = rec;
+}
+
+/* Drop every group, free_members also hands the member trees back to node_pool (not needed when the pool is destroyed) */
+void programmeClear(bool free_members){
+    for (int i = 0; i < programme_index.num_buckets; i++){
+        ProgrammeGroup *group = programme_index.buckets[i];
+        while (group != NULL){
+            ProgrammeGroup *next = group->next;
+            if (free_members) freeNodes(group->members);
+            free(group);
+            group = next;
+        }
+    }
+    free(programme_index.buckets);
+    programme_index = (ProgrammeIndex){NULL, 0, 0};
+    programmeForget(NULL);
+}
+
+/* ========== Name index ========== */
+
+/*
+ * Ternary search tree over lowercased names, for QUERY NAME=<prefix>.
+ * Each node holds one character: lo and hi lead to other characters in the same position, eq to the next position.
+ * Records hang off the node of the last character of their name, in id order.
+ */
+typedef struct NameEntry {
+    StudentRecord *rec;
+    struct NameEntry *next;
+} NameEntry;
+
+typedef struct NameNode {
+    unsigned char c;
+    struct NameNode *lo;
+    struct NameNode *eq;
+    struct NameNode *hi;
+    NameEntry *records; // Records whose whole name ends on this node
+    NameEntry *last; // Tail of records, loads come in id order and go straight on the end
+} NameNode;
+
+Pool name_node_pool = POOL_INIT(NameNode, sizeof(void *));
+Pool name_entry_pool = POOL_INIT(NameEntry, sizeof(void *));
+NameNode *name_index = NULL;
+
+void nameAdd(StudentRecord *rec){
+    const char *p = rec->name;
+    if (*p == '\0') return; // An empty name can't be searched for
+    NameNode **link = &name_index;
+    while (1){
+        unsigned char c = (unsigned char)tolower((unsigned char)*p);
+        NameNode *node = *link;
+        if (node == NULL){
+            node = poolAlloc(&name_node_pool);
+            node->c = c;
+            node->lo = NULL;
+            node->eq = NULL;
+            node->hi = NULL;
+            node->records = NULL;
+            node->last = NULL;
+            *link = node;
+        }
+        if (c < node->c){
+            link = &node->lo;
+        }
+        else if (c > node->c){
+            link = &node->hi;
+        }
+        else if (p[1] != '\0'){
+            link = &node->eq;
+            p++;
+        }
+        else{
+            NameEntry **at = &node->records;
+            if (node->last != NULL && node->last->rec->id < rec->id){
+                at = &node->last->next;
             }
             else{
-                /**
-                 * summaryStatistics not null means we are using traversal for sumamry      
-                 * summaryStatistics array will be in this format
-                 * [<lowest_mark>,<highest_mark>,<id of student with lowest_mark>,<id of student with highest_mark>, <total_marks>]
-                 */
-                if (root->keys[key_to_index]->mark < summaryStatistics[0]){
-                    summaryStatistics[0] = root->keys[key_to_index]->mark;
-                    summaryStatistics[2] = root->keys[key_to_index]->id;
-
-                }
-                if (root->keys[key_to_index]->mark > summaryStatistics[1]){
-                    summaryStatistics[1] = root->keys[key_to_index]->mark;
-                    summaryStatistics[3] = root->keys[key_to_index]->id;
-                }
-                summaryStatistics[4] += root->keys[key_to_index]->mark;
+                while (*at != NULL && (*at)->rec->id < rec->id) at = &(*at)->next;
             }
+            NameEntry *entry = poolAlloc(&name_entry_pool);
+            entry->rec = rec;
+            entry->next = *at;
+            *at = entry;
+            if (entry->next == NULL) node->last = entry;
+            return;
         }
-        traversal(root->children[i], descending, summaryStatistics, file);
-       
     }
 }
 
-void showAllByMarks(BTreeNode *root, int *p_num_students, bool descending){
-    StudentRecord **studentRecordsArr = calloc(*p_num_students, sizeof(StudentRecord *));
-    if (studentRecordsArr == NULL) {
-      fprintf(stderr, "Memory allocation failed!\n");
+/* Unlink rec from the subtree at *link, p is the rest of its name, nodes left with nothing under them are freed */
+void nameRemoveFrom(NameNode **link, const char *p, StudentRecord *rec){
+    NameNode *node = *link;
+    if (node == NULL) return;
+    unsigned char c = (unsigned char)tolower((unsigned char)*p);
+    if (c < node->c){
+        nameRemoveFrom(&node->lo, p, rec);
+    }
+    else if (c > node->c){
+        nameRemoveFrom(&node->hi, p, rec);
+    }
+    else if (p[1] != '\0'){
+        nameRemoveFrom(&node->eq, p + 1, rec);
     }
     else{
-        int counter = *p_num_students;
-        int*p_counter = &counter;//Copying num_students so we dont end up modifying the original value
-        collectRecords(root, studentRecordsArr, p_counter);
-        descending ? qsort(studentRecordsArr, *p_num_students, sizeof(StudentRecord *), sortmarkDESC) : qsort(studentRecordsArr, *p_num_students, sizeof(StudentRecord *), sortmarkASC);
-        for (int i = 0; i < *p_num_students; i++){
-            printRecord(studentRecordsArr[i] , NULL);
+        NameEntry **at = &node->records;
+        NameEntry *prev = NULL;
+        while (*at != NULL && (*at)->rec != rec){
+            prev = *at;
+            at = &(*at)->next;
+        }
+        if (*at != NULL){
+            NameEntry *entry = *at;
+            *at = entry->next;
+            if (node->last == entry) node->last = prev;
+            poolFree(&name_entry_pool, entry);
         }
-        free(studentRecordsArr);
+    }
+    if (node->records == NULL && node->lo == NULL && node->eq == NULL && node->hi == NULL){
+        poolFree(&name_node_pool, node);
+        *link = NULL;
     }
 }
 
-void input_save(BTreeNode *root, const char* filename ){
-    FILE *file = fopen(filename, "w");
-    if (file == NULL){
-        printf("The file cannot be found.\n");
+void nameRemove(StudentRecord *rec){
+    if (rec->name[0] != '\0') nameRemoveFrom(&name_index, rec->name, rec);
+}
+
+/* Node of the last character of prefix, NULL if no name starts with it */
+NameNode *findNamePrefix(const char *prefix){
+    NameNode *node = name_index;
+    while (node != NULL){
+        unsigned char c = (unsigned char)tolower((unsigned char)*prefix);
+        if (c < node->c){
+            node = node->lo;
+        }
+        else if (c > node->c){
+            node = node->hi;
+        }
+        else if (prefix[1] != '\0'){
+            node = node->eq;
+            prefix++;
+        }
+        else{
+            return node;
+        }
+    }
+    return NULL;
+}
+
+/* ========== Mark column ========== */
+
+/*
+ * Every mark again in one packed array, in no particular order, so whole-database aggregates stream
+ * 4 bytes per student instead of chasing tree pointers to 200 byte records. records[i] is the owner of
+ * marks[i] and records[i]->slot == i, which lets a removal swap the last entry into the gap.
+ * The kernels use AVX2 or SSE2 when the compiler targets them (e.g. -mavx2), plain C otherwise.
+ */
+typedef struct MarkColumn {
+    float *marks;
+    StudentRecord **records;
+    int count;
+    int capacity;
+} MarkColumn;
+
+MarkColumn mark_column = {NULL, NULL, 0, 0};
+
+void columnAdd(StudentRecord *rec){
+    if (mark_column.count == mark_column.capacity){
+        int capacity = mark_column.capacity ? mark_column.capacity * 2 : 1024;
+        float *marks = realloc(mark_column.marks, capacity * sizeof(float));
+        if (marks == NULL){
+            perror("Memory allocation failed");
+            exit(EXIT_FAILURE);
+        }
+        mark_column.marks = marks;
+        StudentRecord **records = realloc(mark_column.records, capacity * sizeof(StudentRecord *));
+        if (records == NULL){
+            perror("Memory allocation failed");
+            exit(EXIT_FAILURE);
+        }
+        mark_column.records = records;
+        mark_column.capacity = capacity;
+    }
+    rec->slot = mark_column.count++;
+    mark_column.marks[rec->slot] = rec->mark;
+    mark_column.records[rec->slot] = rec;
+}
+
+void columnRemove(StudentRecord *rec){
+    int last = --mark_column.count;
+    mark_column.marks[rec->slot] = mark_column.marks[last];
+    mark_column.records[rec->slot] = mark_column.records[last];
+    mark_column.records[rec->slot]->slot = rec->slot;
+}
+
+/* Called once rec's mark has changed, its slot stays where it is */
+void columnUpdate(StudentRecord *rec){
+    mark_column.marks[rec->slot] = rec->mark;
+}
+
+void columnClear(){
+    free(mark_column.marks);
+    free(mark_column.records);
+    mark_column = (MarkColumn){NULL, NULL, 0, 0};
+}
+
+/* Sum of marks[0..n-1], or of their squares, added up in double precision */
+double columnSum(const float *marks, int n, bool squares){
+    int i = 0;
+    double total = 0;
+#if defined(__AVX2__)
+    __m256d acc_lo = _mm256_setzero_pd();
+    __m256d acc_hi = _mm256_setzero_pd();
+    for (; i + 8 <= n; i += 8){
+        __m256 v = _mm256_loadu_ps(marks + i);
+        __m256d lo = _mm256_cvtps_pd(_mm256_castps256_ps128(v));
+        __m256d hi = _mm256_cvtps_pd(_mm256_extractf128_ps(v, 1));
+        if (squares){
+            lo = _mm256_mul_pd(lo, lo);
+            hi = _mm256_mul_pd(hi, hi);
+        }
+        acc_lo = _mm256_add_pd(acc_lo, lo);
+        acc_hi = _mm256_add_pd(acc_hi, hi);
+    }
+    double lanes[4];
+    _mm256_storeu_pd(lanes, _mm256_add_pd(acc_lo, acc_hi));
+    total = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#elif defined(__SSE2__)
+    __m128d acc_lo = _mm_setzero_pd();
+    __m128d acc_hi = _mm_setzero_pd();
+    for (; i + 4 <= n; i += 4){
+        __m128 v = _mm_loadu_ps(marks + i);
+        __m128d lo = _mm_cvtps_pd(v);
+        __m128d hi = _mm_cvtps_pd(_mm_movehl_ps(v, v));
+        if (squares){
+            lo = _mm_mul_pd(lo, lo);
+            hi = _mm_mul_pd(hi, hi);
+        }
+        acc_lo = _mm_add_pd(acc_lo, lo);
+        acc_hi = _mm_add_pd(acc_hi, hi);
+    }
+    double lanes[2];
+    _mm_storeu_pd(lanes, _mm_add_pd(acc_lo, acc_hi));
+    total = lanes[0] + lanes[1];
+#endif
+    for (; i < n; i++){
+        total += squares ? (double)marks[i] * marks[i] : marks[i];
+    }
+    return total;
+}
+
+int bitCount(unsigned int bits){
+    int count = 0;
+    for (; bits; bits &= bits - 1) count++;
+    return count;
+}
+
+/* How many of marks[0..n-1] lie in [low, high] */
+int columnCountBetween(const float *marks, int n, float low, float high){
+    int i = 0;
+    int count = 0;
+#if defined(__AVX2__)
+    __m256 vlow = _mm256_set1_ps(low);
+    __m256 vhigh = _mm256_set1_ps(high);
+    for (; i + 8 <= n; i += 8){
+        __m256 v = _mm256_loadu_ps(marks + i);
+        __m256 in = _mm256_and_ps(_mm256_cmp_ps(v, vlow, _CMP_GE_OQ), _mm256_cmp_ps(v, vhigh, _CMP_LE_OQ));
+        count += bitCount((unsigned int)_mm256_movemask_ps(in));
+    }
+#elif defined(__SSE2__)
+    __m128 vlow = _mm_set1_ps(low);
+    __m128 vhigh = _mm_set1_ps(high);
+    for (; i + 4 <= n; i += 4){
+        __m128 v = _mm_loadu_ps(marks + i);
+        __m128 in = _mm_and_ps(_mm_cmpge_ps(v, vlow), _mm_cmple_ps(v, vhigh));
+        count += bitCount((unsigned int)_mm_movemask_ps(in));
+    }
+#endif
+    for (; i < n; i++){
+        if (marks[i] >= low && marks[i] <= high) count++;
+    }
+    return count;
+}
+
+/* Count marks[0..n-1] into num_bins bins of the given width starting at 0, anything past the end lands in the last bin */
+void columnHistogram(const float *marks, int n, int *bins, int num_bins, float width){
+    int i = 0;
+    memset(bins, 0, num_bins * sizeof(int));
+#if defined(__AVX2__)
+    __m256 vwidth = _mm256_set1_ps(width);
+    __m256i vlast = _mm256_set1_epi32(num_bins - 1);
+    int index[8];
+    for (; i + 8 <= n; i += 8){
+        __m256i bin = _mm256_cvttps_epi32(_mm256_div_ps(_mm256_loadu_ps(marks + i), vwidth));
+        _mm256_storeu_si256((__m256i *)index, _mm256_min_epi32(bin, vlast));
+        for (int j = 0; j < 8; j++) bins[index[j]]++;
+    }
+#elif defined(__SSE2__)
+    __m128 vwidth = _mm_set1_ps(width);
+    int index[4];
+    for (; i + 4 <= n; i += 4){
+        _mm_storeu_si128((__m128i *)index, _mm_cvttps_epi32(_mm_div_ps(_mm_loadu_ps(marks + i), vwidth)));
+        for (int j = 0; j < 4; j++) bins[index[j] < num_bins ? index[j] : num_bins - 1]++;
+    }
+#endif
+    for (; i < n; i++){
+        int bin = (int)(marks[i] / width);
+        bins[bin < num_bins ? bin : num_bins - 1]++;
+    }
+}
+
+/* ========== Read views ========== */
+
+/*
+ * A read view is every record as it was at one point in time, for a file write that runs while commands go on.
+ * Opening one only collects the record pointers in ID order. A writer about to change or free a record
+ * that an open view still points at copies the record first and swaps the copy into the view,
+ * so the view never sees a change made after it was opened. A name the copy points at is
+ * kept until every view is closed. Views are opened, closed and preserved into only by
+ * the thread running commands, the writing thread just reads them.
+ */
+#define MAX_READ_VIEWS 2 // A background SAVE and a checkpoint
+
+typedef struct ReadView {
+    StudentRecord **records;
+    int count;
+    Pool copies; // Records as they were before a writer changed or freed them
+} ReadView;
+
+ReadView *read_views[MAX_READ_VIEWS];
+
+// Names given up while a view was open, freed once the last view closes
+char **retired_names = NULL;
+int num_retired = 0;
+int retired_capacity = 0;
+
+bool viewsOpen(){
+    for (int slot = 0; slot < MAX_READ_VIEWS; slot++){
+        if (read_views[slot] != NULL) return true;
+    }
+    return false;
+}
+
+/* Give a record's name slot back to name_heap, or hold on to it while a view may still read it */
+void nameRelease(char *name, size_t len){
+    if (!viewsOpen()){
+        poolFree(&name_heap[nameClass(len)], name);
         return;
     }
-    traversal(root, false, NULL, file);
-    fclose(file);
-    printf("The database file \"%s\" is successfully saved.\n", filename);
+    if (num_retired == retired_capacity){
+        int capacity = retired_capacity ? retired_capacity * 2 : 64;
+        char **grown = realloc(retired_names, capacity * sizeof(char *));
+        if (grown == NULL){
+            perror("Memory allocation failed");
+            exit(EXIT_FAILURE);
+        }
+        retired_names = grown;
+        retired_capacity = capacity;
+    }
+    retired_names[num_retired++] = name;
+}
+
+/* Free a record that is in no index anymore, along with its name */
+void freeRecord(StudentRecord *rec){
+    nameRelease(rec->name, rec->name_len);
+    poolFree(&record_pool, rec);
+}
+
+/* Returns 1 if the view cannot be opened */
+int viewOpen(ReadView *view, BTreeNode *root, int num_students){
+    int slot = 0;
+    while (slot < MAX_READ_VIEWS && read_views[slot] != NULL) slot++;
+    view->records = malloc((num_students ? num_students : 1) * sizeof(StudentRecord *));
+    if (slot == MAX_READ_VIEWS || view->records == NULL){
+        free(view->records);
+        view->records = NULL;
+        return 1;
+    }
+    view->count = 0;
+    collectRecords(root, view->records, &view->count);
+    view->copies = (Pool)POOL_INIT(StudentRecord, sizeof(void *));
+    read_views[slot] = view;
+    return 0;
+}
+
+/* Only once nothing reads the view anymore */
+void viewClose(ReadView *view){
+    for (int slot = 0; slot < MAX_READ_VIEWS; slot++){
+        if (read_views[slot] == view) read_views[slot] = NULL;
+    }
+    free(view->records);
+    view->records = NULL;
+    poolDestroy(&view->copies);
+    if (!viewsOpen()){
+        for (int i = 0; i < num_retired; i++){
+            poolFree(&name_heap[nameClass(strlen(retired_names[i]))], retired_names[i]);
+        }
+        num_retired = 0;
+    }
+}
+
+/* Called before rec is changed or freed, keeps its current fields in every open view that still points at it */
+void viewPreserve(StudentRecord *rec){
+    for (int slot = 0; slot < MAX_READ_VIEWS; slot++){
+        ReadView *view = read_views[slot];
+        if (view == NULL) continue;
+        int low = 0, high = view->count - 1;
+        while (low <= high){
+            int mid = low + (high - low) / 2;
+            if (view->records[mid]->id < rec->id) low = mid + 1;
+            else if (view->records[mid]->id > rec->id) high = mid - 1;
+            else{
+                if (view->records[mid] != rec) break; // Already preserved, or a later record under the same id
+                StudentRecord *copy = poolAlloc(&view->copies); // Exits if out of memory, never NULL
+                *copy = *rec;
+                __atomic_store_n(&view->records[mid], copy, __ATOMIC_RELEASE);
+                break;
+            }
+        }
+    }
+}
+
+/* records[i] copied into copy as one consistent record, a writer may swap in a preserved copy or change the record meanwhile */
+StudentRecord *viewRecord(StudentRecord **records, int i, RecordCopy *copy){
+    while (1){
+        StudentRecord *rec = __atomic_load_n(&records[i], __ATOMIC_ACQUIRE);
+        // Still in the slot means no writer had started on it, the version alone misses a record freed and reused
+        if (copyRecord(rec, copy) && __atomic_load_n(&records[i], __ATOMIC_RELAXED) == rec) return &copy->rec;
+    }
+}
+
+/* File a record that just went into the primary index in the secondary indexes and the stats */
+void indexRecord(StudentRecord *rec) {
+    insert(&mark_index, markKey(rec), rec);
+    statsAdd(rec->mark);
+    columnAdd(rec);
+    programmeAdd(rec);
+    nameAdd(rec);
+}
+
+/* Take a record out of the secondary indexes and the stats, while its fields still match how it was filed */
+void unindexRecord(StudentRecord *rec) {
+    removeFromTree(&mark_index, markKey(rec));
+    statsRemove(rec->mark);
+    columnRemove(rec);
+    programmeRemove(rec);
+    nameRemove(rec);
+}
+
+/* Change a record's mark and move it to its new place in the mark index, the name and programme indexes are left alone */
+void setMark(StudentRecord *rec, float mark) {
+    viewPreserve(rec);
+    float old = rec->mark;
+    removeFromTree(&mark_index, markKey(rec));
+    statsRemove(old);
+    versionLock(&rec->version);
+    rec->mark = mark;
+    versionUnlock(&rec->version);
+    insert(&mark_index, markKey(rec), rec);
+    statsAdd(mark);
+    columnUpdate(rec);
+    programmeMarkChanged(rec, old);
+}
+
+/* Change a record's name and refile it in the name index, nothing else is keyed on the name */
+void setName(StudentRecord *rec, const char *name) {
+    viewPreserve(rec);
+    nameRemove(rec);
+    char *old = rec->name;
+    size_t old_len = rec->name_len;
+    size_t len = strlen(name);
+    char *stored = nameStore(name_heap, name, len);
+    versionLock(&rec->version);
+    rec->name = stored;
+    rec->name_len = (uint8_t)len;
+    versionUnlock(&rec->version);
+    nameRelease(old, old_len);
+    nameAdd(rec);
+}
+
+/* Change a record's programme and move it to its new programme group, nothing else is keyed on the programme */
+void setProgramme(StudentRecord *rec, const char *programme) {
+    viewPreserve(rec);
+    programmeRemove(rec);
+    uint16_t code = programmeIntern(programme, strlen(programme));
+    versionLock(&rec->version);
+    rec->programme = code;
+    versionUnlock(&rec->version);
+    programmeAdd(rec);
+}
+
+/* Unlink id from the tree rooted at *rootRef and free its record, returns 1 if it was not there */
+int removeRecord(BTreeNode **rootRef, int id, int *num_students) {
+    StudentRecord *removed = removeFromTree(rootRef, (BTreeKey)id);
+    if (removed == NULL) return 1;
+
+    unindexRecord(removed);
+    viewPreserve(removed);
+    versionLock(&removed->version); // A view reader still holding the pointer retries and finds the preserved copy
+    versionUnlock(&removed->version);
+    freeRecord(removed);
+    *num_students -= 1;
+    return 0;
+}
+
+/* Public wrapper to delete key id from tree rooted at *root */
+int deleteKey(BTreeNode **rootRef, int id, int*num_students, OutBuffer *out) {
+    treeWriteBegin();
+    int result = removeRecord(rootRef, id, num_students);
+    treeWriteEnd();
+    if (result == 1){
+        outPrintf(out, "ID %d not found in database!\n", id);
+        return 1;
+    }
+    note(out, "ID %d deleted successfully\n", id);
+    return 0;
+}
+
+/* ========== Bulk loading ========== */
+
+/* Max number of keys a subtree of the given height can hold when every node is full */
+long long subtreeCapacity(int height) {
+    long long capacity = MAX_KEYS;
+    for (int h = 0; h < height; h++) {
+        capacity = capacity * MAX_CHILDREN + MAX_KEYS;
+    }
+    return capacity;
+}
+
+/*
+ * Build a subtree of the given height from records[0..n-1], which must be sorted by the tree's key.
+ * Uses as few children as possible so nodes come out close to full, but never fewer than
+ * MIN_DEGREE (or 2 at the root) so every node still satisfies the B tree minimums.
+ */
+BTreeNode *buildSubtree(StudentRecord **records, int n, int height, bool is_root, bool by_mark) {
+    BTreeNode *node = createNode(height == 0);
+
+    if (height == 0) {
+        for (int i = 0; i < n; i++) {
+            setKey(node, i, recordKey(records[i], by_mark), records[i]);
+        }
+        node->num_keys = n;
+        node->count = n;
+        return node;
+    }
+
+    long long child_capacity = subtreeCapacity(height - 1);
+    int num_children = (int)((n + 1 + child_capacity) / (child_capacity + 1)); // ceil((n + 1) / (child_capacity + 1))
+    int min_children = is_root ? 2 : MIN_DEGREE;
+    if (num_children < min_children) num_children = min_children;
+
+    // Keys left over once one separator sits between each pair of children, spread evenly
+    int child_keys = n - (num_children - 1);
+    int base = child_keys / num_children;
+    int extra = child_keys % num_children;
+    int pos = 0;
+
+    for (int c = 0; c < num_children; c++) {
+        int size = base + (c < extra ? 1 : 0);
+        node->children[c] = buildSubtree(records + pos, size, height - 1, false, by_mark);
+        pos += size;
+        if (c < num_children - 1) {
+            setKey(node, c, recordKey(records[pos], by_mark), records[pos]); // separator
+            pos++;
+        }
+    }
+    node->num_keys = num_children - 1;
+    node->count = n;
+    return node;
+}
+
+/* Build a whole tree bottom up from n records sorted by id, or by markKey for the mark index */
+BTreeNode *buildTree(StudentRecord **records, int n, bool by_mark) {
+    if (n == 0) return NULL;
+    int height = 0;
+    while (subtreeCapacity(height) < n) height++;
+    return buildSubtree(records, n, height, true, by_mark);
+}
+
+/* A line of the file that could not be loaded */
+typedef struct ParseError {
+    int line; // Line number starting at 1, within its chunk until the chunks are joined. 0 for a snapshot, which has no lines
+    int id; // ID of the rejected record, 0 if the line has no valid ID
+    const char *message;
+} ParseError;
+
+/* Errors of one load, kept instead of printed so parse errors and duplicates come out together in file order */
+typedef struct ErrorList {
+    ParseError *errors;
+    int count;
+    int capacity;
+} ErrorList;
+
+void errorAppend(ErrorList *list, int line, int id, const char *message){
+    if (list->count == list->capacity) {
+        int capacity = list->capacity ? list->capacity * 2 : 16;
+        ParseError *grown = realloc(list->errors, capacity * sizeof(ParseError));
+        if (grown == NULL) {
+            perror("Memory allocation failed");
+            exit(EXIT_FAILURE);
+        }
+        list->errors = grown;
+        list->capacity = capacity;
+    }
+    ParseError error = {line, id, message};
+    list->errors[list->count++] = error;
+}
+
+int sortErrorLine(const void *a, const void *b) {
+    const ParseError *errorA = a;
+    const ParseError *errorB = b;
+    if (errorA->line != errorB->line) return errorA->line < errorB->line ? -1 : 1;
+    return (errorA->id > errorB->id) - (errorA->id < errorB->id);
+}
+
+/* Print the errors in file order and empty the list */
+void printLoadErrors(ErrorList *list, OutBuffer *out){
+    if (list->count > 0) qsort(list->errors, list->count, sizeof(ParseError), sortErrorLine); // errors is NULL until the first one
+    for (int e = 0; e < list->count; e++) {
+        ParseError *error = &list->errors[e];
+        if (error->line == 0) {
+            outPrintf(out, "Failure to insert record with %s=%d: %s\n", ID, error->id, error->message);
+        }
+        else if (error->id != 0) {
+            outPrintf(out, "Line %d: Failure to insert record with %s=%d: %s\n", error->line, ID, error->id, error->message);
+        }
+        else {
+            outPrintf(out, "Line %d: %s\n", error->line, error->message);
+        }
+    }
+    free(list->errors);
+    list->errors = NULL;
+    list->count = 0;
+    list->capacity = 0;
+}
+
+/* A record of a batch being loaded, with where it came in so duplicate ids sort the same on every platform */
+typedef struct LoadEntry {
+    int id;
+    int index;
+    int line;
+    StudentRecord *rec;
+} LoadEntry;
+
+/* By id, then by position in the batch, so the earliest of a duplicate id comes first and is the one kept */
+int sortLoadEntry(const void *a, const void *b) {
+    const LoadEntry *entryA = a;
+    const LoadEntry *entryB = b;
+    if (entryA->id != entryB->id) return entryA->id < entryB->id ? -1 : 1;
+    return (entryA->index > entryB->index) - (entryA->index < entryB->index);
+}
+
+/* Sort records, and their lines if given, by id in place, keeping records that share an id in batch order. Returns 1 if out of memory */
+int sortLoadBatch(StudentRecord **records, int *lines, int count) {
+    LoadEntry *entries = malloc((count ? count : 1) * sizeof(LoadEntry));
+    if (entries == NULL) return 1;
+    for (int i = 0; i < count; i++) {
+        entries[i].id = records[i]->id;
+        entries[i].index = i;
+        entries[i].line = lines ? lines[i] : 0;
+        entries[i].rec = records[i];
+    }
+    qsort(entries, count, sizeof(LoadEntry), sortLoadEntry);
+    for (int i = 0; i < count; i++) {
+        records[i] = entries[i].rec;
+        if (lines) lines[i] = entries[i].line;
+    }
+    free(entries);
+    return 0;
+}
+
+/*
+ * Load a batch of new records into the tree in one go.
+ * The batch is sorted by id, merged with the records already in the tree and
+ * duplicates are rejected in a single linear pass, then the tree is rebuilt bottom up.
+ * lines, or NULL, holds the line each record was read from, rejected records go into errors under it.
+ * Rejected records are freed, ownership of the rest moves into the tree.
+ */
+int bulkLoad(BTreeNode **root, StudentRecord **records, int *lines, int count, int *num_students, ErrorList *errors, OutBuffer *out) {
+    // Snapshots are already in ID order, only sort when something is out of place
+    for (int i = 1; i < count; i++) {
+        if (records[i - 1]->id > records[i]->id) {
+            if (sortLoadBatch(records, lines, count) == 1) {
+                outPrintf(out, "Memory allocation failed.\n");
+                for (int j = 0; j < count; j++) freeRecord(records[j]);
+                return 1;
+            }
+            break;
+        }
+    }
+
+    int num_existing = 0;
+    StudentRecord **merged = malloc((size_t)(*num_students + count) * sizeof(StudentRecord *));
+    if (merged == NULL) {
+        outPrintf(out, "Memory allocation failed.\n");
+        for (int i = 0; i < count; i++) freeRecord(records[i]);
+        return 1;
+    }
+    // Existing records go at the back of the buffer so the merge can write from the front
+    StudentRecord **existing = merged + count;
+    collectRecords(*root, existing, &num_existing);
+
+    int i = 0, j = 0, m = 0;
+    while (i < num_existing || j < count) {
+        if (j == count || (i < num_existing && existing[i]->id <= records[j]->id)) {
+            merged[m++] = existing[i++];
+        }
+        else if (m > 0 && merged[m - 1]->id == records[j]->id) {
+            errorAppend(errors, lines ? lines[j] : 0, records[j]->id, "The record already exists");
+            freeRecord(records[j++]);
+        }
+        else {
+            merged[m++] = records[j++];
+        }
+    }
+
+    freeNodes(*root);
+    *root = buildTree(merged, m, false);
+    *num_students = m;
+
+    programmeClear(true);
+    poolDestroy(&name_node_pool);
+    poolDestroy(&name_entry_pool);
+    name_index = NULL;
+    columnClear();
+    for (i = 0; i < m; i++) {
+        columnAdd(merged[i]);
+        programmeAdd(merged[i]);
+        nameAdd(merged[i]);
+    }
+
+    // The mark index is rebuilt the same way. merged is in id order and the column holds its marks in the same order
+    StudentRecord **by_mark = malloc((m ? m : 1) * sizeof(StudentRecord *));
+    if (by_mark == NULL || sortByMark(merged, mark_column.marks, m, by_mark) == 1){
+        free(by_mark);
+        by_mark = merged; // Short of memory, sort in place instead
+        merged = NULL;
+        qsort(by_mark, m, sizeof(StudentRecord *), sortmarkKeyASC);
+    }
+    freeNodes(mark_index);
+    mark_index = buildTree(by_mark, m, true);
+
+    free(merged);
+    free(by_mark);
+
+    // Totals start from a fresh pass over the column rather than whatever the old ones had drifted to
+    mark_stats.count = m;
+    mark_stats.sum = columnSum(mark_column.marks, m, false);
+    mark_stats.sum_squares = columnSum(mark_column.marks, m, true);
+    return 0;
+}
+
+int createAndInsert(
+    BTreeNode **root,
+    int id,
+    char *name,
+    char *programme,
+    float mark,
+    int* num_students,
+    OutBuffer *out){
+    //Creates a studentrecord struct, and inserts it into the b tree
+    treeWriteBegin(); // Held from the duplicate check to the insert, so no other writer gets in between
+    if (searchIndex(*root, id) != NULL){
+        treeWriteEnd();
+        outPrintf(out, "The record with %s=%d already exists\n", ID, id);
+        return 1;
+    }
+    const char *error = recordError(id, name, strlen(name), programme, strlen(programme), mark);
+    if (error != NULL) {
+        treeWriteEnd();
+        outPrintf(out, "%s\n", error);
+        return 1;
+    }
+    StudentRecord *newRec = createRecord(&record_pool, name_heap, id, name, strlen(name), programmeIntern(programme, strlen(programme)), mark);
+    insert(root, newRec->id, newRec);
+    indexRecord(newRec);
+    *num_students += 1;
+    treeWriteEnd();
+
+    note(out, "ID %d successfully inserted\n", id);
+    return 0;
+}
+
+int updateFields(BTreeNode *root, int search_index,char *field, char *value, OutBuffer *out){
+    StudentRecord * p_record = searchIndex(root, search_index);
+    if (p_record){
+        if (strcmp(field, "mark") == 0) {
+            char *endptr;
+            float f = strtof(value, &endptr);
+            if (*endptr == '\0'){
+                if (!(f >= MIN_MARK && f <= MAX_MARK)){ // Also turns away nan
+                    outPrintf(out, "Please enter a valid mark between 0-100");
+                    return 1;
+                }
+                setMark(p_record, f);
+                return 0;
+            }
+            else{
+                outPrintf(out, "Invalid data type! Must be type float!\n");
+                return 1;
+            }
+        }
+        // if field is 'name', update the name
+        else if (strcmp(field, "name") == 0) {
+            if (checkTypeAndLen(value, MAX_NAME, out) == 1){
+                outPrintf(out, "Invalid data type for name!\n");
+                return 1;
+            }
+            setName(p_record, value);
+            note(out, "The record with ID=%d is successfully updated.\n", search_index);
+            return 0;
+        }
+        // if field is 'programme', update the programme
+        else if (strcmp(field, "programme") == 0) {
+            if (checkTypeAndLen(value, MAX_PROGRAMME, out) == 1){
+                outPrintf(out, "Invalid data type for programme!\n");
+                return 1;
+            }
+            setProgramme(p_record, value);
+            note(out, "The record with ID=%d is successfully updated.\n", search_index);
+            return 0;
+        }
+    }
+    else{
+        outPrintf(out, "Record with ID=%d not found!\n", search_index);
+    }
+    return 1;
+}
+
+int updateStudentRecord(BTreeNode *root, int search_index,char *field, char *value, OutBuffer *out){
+    treeWriteBegin();
+    int result = updateFields(root, search_index, field, value, out);
+    treeWriteEnd();
+    return result;
+}
+
+
+/* Tear down the whole database in one go, every record and node goes back with its pool */
+void destroyDatabase(BTreeNode **root, int *num_students) {
+    poolDestroy(&record_pool);
+    for (int c = 0; c < NAME_CLASSES; c++) poolDestroy(&name_heap[c]);
+    poolDestroy(&node_pool);
+    *root = NULL;
+    mark_index = NULL;
+    mark_stats = (MarkStats){0, 0, 0};
+    programmeClear(false);
+    columnClear();
+    poolDestroy(&name_node_pool);
+    poolDestroy(&name_entry_pool);
+    name_index = NULL;
+    *num_students = 0;
+}
+
+/* ========== Record rows ========== */
+
+/* Spaces up to width after something len characters long, like the padding of %-*s */
+void outPad(OutBuffer *out, size_t len, int width){
+    for (int i = (int)len; i < width; i++){
+        outChar(out, ' ');
+    }
+}
+
+/* Same as printf("%-*s", width, str) */
+void outString(OutBuffer *out, const char *str, int width){
+    size_t len = strlen(str);
+    outBytes(out, str, len);
+    outPad(out, len, width);
+}
+
+/* Same as printf("%-*d", width, value) */
+void outInt(OutBuffer *out, int value, int width){
+    char digits[12];
+    int n = sizeof(digits);
+    unsigned int magnitude = value < 0 ? 0u - (unsigned int)value : (unsigned int)value;
+    do {
+        digits[--n] = (char)('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude > 0);
+    if (value < 0) digits[--n] = '-';
+    outBytes(out, digits + n, sizeof(digits) - n);
+    outPad(out, sizeof(digits) - n, width);
+}
+
+/*
+ * Same as printf("%-*.1f", width, value).
+ * A float times 10 is exact in a double, so the only ties are real ones and those round to even like printf does.
+ */
+void outMark(OutBuffer *out, float value, int width){
+    double scaled = (double)value * 10;
+    bool negative = scaled < 0;
+    if (negative) scaled = -scaled;
+    long long tenths = (long long)scaled;
+    double fraction = scaled - (double)tenths;
+    if (fraction > 0.5 || (fraction == 0.5 && (tenths & 1))) tenths++;
+
+    char digits[24];
+    int n = sizeof(digits);
+    digits[--n] = (char)('0' + tenths % 10);
+    digits[--n] = '.';
+    tenths /= 10;
+    do {
+        digits[--n] = (char)('0' + tenths % 10);
+        tenths /= 10;
+    } while (tenths > 0);
+    if (negative) digits[--n] = '-';
+    outBytes(out, digits + n, sizeof(digits) - n);
+    outPad(out, sizeof(digits) - n, width);
+}
+
+/*Printing Records*/
+void printRecord(StudentRecord *rec, OutBuffer *out) {
+    //Table row for the console, or a CSV line when the buffer goes to a file
+    if (!out->csv){
+        outInt(out, rec->id, 10);
+        outChar(out, ' ');
+        outString(out, rec->name, 15);
+        outChar(out, ' ');
+        outString(out, programmeText(rec->programme), 25);
+        outChar(out, ' ');
+        outMark(out, rec->mark, 5);
+        outChar(out, '\n');
+    }
+    else{
+        outInt(out, rec->id, 0);
+        outChar(out, ',');
+        outString(out, rec->name, 0);
+        outChar(out, ',');
+        outString(out, programmeText(rec->programme), 0);
+        outChar(out, ',');
+        outMark(out, rec->mark, 0);
+        outChar(out, '\n');
+    }
+}
+
+void printHeader(OutBuffer *out){
+    outString(out, ID, 10);
+    outChar(out, ' ');
+    outString(out, NAME, 15);
+    outChar(out, ' ');
+    outString(out, PROGRAMME, 25);
+    outChar(out, ' ');
+    outString(out, MARK, 5);
+    outChar(out, '\n');
+}
+
+/*Show ALl functions*/
+/*
+ * Print limit records of tree in key order starting offset records in, limit -1 for no limit.
+ * The cursor jumps straight to the first record of the page, so a late page costs no more than the first.
+ */
+void showPage(BTreeNode *tree, bool descending, int limit, int offset, OutBuffer* out) {
+    int total = treeSize(tree);
+    Cursor cursor;
+    cursorSeekRank(&cursor, tree, descending ? total - 1 - offset : offset);
+    for (int printed = 0; printed != limit && cursorRecord(&cursor) != NULL; printed++) {
+        printRecord(cursorRecord(&cursor), out);
+        if (descending) {
+            cursorPrev(&cursor);
+        }
+        else {
+            cursorNext(&cursor);
+        }
+    }
 }
 
 int safe_atoi(const char *s, int *out) {
@@ -676,390 +2600,3053 @@ int safe_atoi(const char *s, int *out) {
 
     if (errno == ERANGE) return -1;
 
-    *out = (int)val;
-    return *out;
+    *out = (int)val;
+    return *out;
+}
+
+
+/* ========== CSV loading ========== */
+
+typedef struct MappedFile {
+    const char *data;
+    size_t size;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#else
+    int fd;
+#endif
+} MappedFile;
+
+/* Map a whole file read only, returns 1 on failure */
+int mapFile(const char *filename, MappedFile *mapped, OutBuffer *out){
+    mapped->data = NULL;
+    mapped->size = 0;
+#ifdef _WIN32
+    mapped->mapping = NULL;
+    mapped->file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (mapped->file == INVALID_HANDLE_VALUE) {
+        outPrintf(out, "Failed to open file: %s\n", filename);
+        return 1;
+    }
+    LARGE_INTEGER size;
+    GetFileSizeEx(mapped->file, &size);
+    mapped->size = (size_t)size.QuadPart;
+    if (mapped->size > 0) {
+        mapped->mapping = CreateFileMappingA(mapped->file, NULL, PAGE_READONLY, 0, 0, NULL);
+        mapped->data = mapped->mapping ? MapViewOfFile(mapped->mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+        if (mapped->data == NULL) {
+            outPrintf(out, "Failed to map file: %s\n", filename);
+            if (mapped->mapping) CloseHandle(mapped->mapping);
+            CloseHandle(mapped->file);
+            return 1;
+        }
+    }
+#else
+    mapped->fd = open(filename, O_RDONLY);
+    if (mapped->fd == -1) {
+        outPrintf(out, "Failed to open file: %s\n", strerror(errno));
+        return 1;
+    }
+    struct stat st;
+    if (fstat(mapped->fd, &st) == -1) {
+        outPrintf(out, "Failed to open file: %s\n", strerror(errno));
+        close(mapped->fd);
+        return 1;
+    }
+    mapped->size = (size_t)st.st_size;
+    if (mapped->size > 0) {
+        void *data = mmap(NULL, mapped->size, PROT_READ, MAP_PRIVATE, mapped->fd, 0);
+        if (data == MAP_FAILED) {
+            outPrintf(out, "Failed to map file: %s\n", strerror(errno));
+            close(mapped->fd);
+            return 1;
+        }
+        madvise(data, mapped->size, MADV_SEQUENTIAL);
+        mapped->data = data;
+    }
+#endif
+    return 0;
+}
+
+void unmapFile(MappedFile *mapped){
+#ifdef _WIN32
+    if (mapped->data) UnmapViewOfFile(mapped->data);
+    if (mapped->mapping) CloseHandle(mapped->mapping);
+    CloseHandle(mapped->file);
+#else
+    if (mapped->data) munmap((void *)mapped->data, mapped->size);
+    close(mapped->fd);
+#endif
+}
+
+/* Trim spaces and tabs off both ends of the field [*start, *end) */
+void trimField(const char **start, const char **end){
+    while (*start < *end && (**start == ' ' || **start == '\t')) (*start)++;
+    while (*end > *start && ((*end)[-1] == ' ' || (*end)[-1] == '\t')) (*end)--;
+}
+
+/* Parse an ID field in place, returns -1 if it is not a number between MIN_ID and MAX_ID */
+int parseIdField(const char *start, const char *end){
+    trimField(&start, &end);
+    if (start == end || end - start > 7) return -1; // MAX_ID has 7 digits
+    int id = 0;
+    for (const char *p = start; p < end; p++){
+        if (*p < '0' || *p > '9') return -1;
+        id = id * 10 + (*p - '0');
+    }
+    if (id < MIN_ID || id > MAX_ID) return -1;
+    return id;
+}
+
+/* Parse a mark field like 72 or 72.5 in place, returns 1 if it is not a plain decimal */
+int parseMarkField(const char *start, const char *end, float *mark){
+    trimField(&start, &end);
+    long digits = 0;
+    long scale = 1;
+    int num_digits = 0;
+    bool seen_point = false;
+    for (const char *p = start; p < end; p++){
+        if (*p == '.' && !seen_point){
+            seen_point = true;
+        }
+        else if (*p >= '0' && *p <= '9' && num_digits < 9){
+            digits = digits * 10 + (*p - '0');
+            if (seen_point) scale *= 10;
+            num_digits++;
+        }
+        else{
+            return 1;
+        }
+    }
+    if (num_digits == 0) return 1;
+    *mark = (float)((double)digits / scale);
+    return 0;
+}
+
+/* Records parsed out of a buffer, in the order they appear */
+typedef struct RecordBatch {
+    StudentRecord **records;
+    int *lines; // Line each record was read from
+    int count;
+    int capacity;
+} RecordBatch;
+
+int batchAppend(RecordBatch *batch, StudentRecord *rec, int line){
+    if (batch->count == batch->capacity) {
+        int capacity = batch->capacity ? batch->capacity * 2 : 1024;
+        StudentRecord **grown = realloc(batch->records, capacity * sizeof(StudentRecord *));
+        if (grown == NULL) {
+            return 1;
+        }
+        batch->records = grown;
+        int *grown_lines = realloc(batch->lines, capacity * sizeof(int));
+        if (grown_lines == NULL) {
+            return 1;
+        }
+        batch->lines = grown_lines;
+        batch->capacity = capacity;
+    }
+    batch->lines[batch->count] = line;
+    batch->records[batch->count++] = rec;
+    return 0;
+}
+
+/*Parallel loading parameters*/
+#define PARALLEL_PARSE_MIN_BYTES (1 << 20) // Files smaller than this are parsed on the calling thread
+#define MAX_PARSE_THREADS 64
+
+/* One newline aligned slice of the file, parsed independently of the others */
+typedef struct ParseJob {
+    const char *begin;
+    const char *end;
+    Pool pool; // Records of this chunk, handed to record_pool once every chunk is done
+    Pool names[NAME_CLASSES]; // Their names, handed to name_heap the same way
+    ProgrammeCache programmes;
+    RecordBatch batch;
+    ErrorList errors;
+    int num_lines;
+    bool out_of_memory;
+} ParseJob;
+
+/*
+ * Parse every line of the job's chunk straight out of the buffer into new records.
+ * Fields are found by scanning for the delimiters and copied once, directly into the record,
+ * so a line can be any length and is never split.
+ */
+void parseRecords(ParseJob *job){
+    const char *line = job->begin;
+    const char *end = job->end;
+    while (line < end) {
+        const char *line_end = memchr(line, '\n', end - line);
+        if (line_end == NULL) line_end = end;
+        const char *next_line = line_end < end ? line_end + 1 : end;
+        if (line_end > line && line_end[-1] == '\r') line_end--; // Windows line endings
+        int line_number = ++job->num_lines;
+
+        if (line_end == line) {
+            line = next_line;
+            continue;
+        }
+
+        // field[i] is where the i-th comma separated field starts, field[i + 1] - 1 is where it ends
+        const char *field[5];
+        int num_fields = 1;
+        field[0] = line;
+        for (const char *p = line; num_fields < 5 && (p = memchr(p, ',', line_end - p)) != NULL; p++) {
+            field[num_fields++] = p + 1;
+        }
+        if (num_fields < 5) field[num_fields] = line_end + 1; // Anything after a fifth field is ignored
+
+        int id = parseIdField(field[0], field[1] - 1);
+        float mark;
+        if (id == -1){
+            errorAppend(&job->errors, line_number, 0, "Invalid ID!");
+        }
+        else if (num_fields < 4){
+            errorAppend(&job->errors, line_number, id, "Malformed input!");
+        }
+        else if (parseMarkField(field[3], field[4] - 1, &mark) == 1) {
+            errorAppend(&job->errors, line_number, id, "Invalid mark!");
+        }
+        else {
+            size_t name_len = field[2] - 1 - field[1];
+            size_t programme_len = field[3] - 1 - field[2];
+            const char *error = recordError(id, field[1], name_len, field[2], programme_len, mark);
+            if (error != NULL){
+                errorAppend(&job->errors, line_number, id, error);
+            }
+            else {
+                StudentRecord *rec = createRecord(&job->pool, job->names, id, field[1], name_len,
+                                                  programmeCached(&job->programmes, field[2], programme_len), mark);
+                if (batchAppend(&job->batch, rec, line_number) == 1){
+                    job->out_of_memory = true;
+                    return;
+                }
+            }
+        }
+        line = next_line;
+    }
+}
+
+#ifndef NO_THREADS
+void *parseWorker(void *arg){
+    parseRecords(arg);
+    return NULL;
+}
+#endif
+
+int numProcessors(){
+#if defined(_WIN32)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#elif defined(_SC_NPROCESSORS_ONLN)
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+#else
+    return 1;
+#endif
+}
+
+/*
+ * Split [data, data + size) into newline aligned chunks and parse them in parallel.
+ * Afterwards the records are concatenated in file order into *records, the line each came from into *lines,
+ * and the errors go into errors with their line numbers in the whole file.
+ */
+int parseFile(const char *data, size_t size, StudentRecord ***records, int **lines, int *count, ErrorList *errors, OutBuffer *out){
+    int num_jobs = 1;
+#ifndef NO_THREADS
+    if (size >= PARALLEL_PARSE_MIN_BYTES) {
+        num_jobs = numProcessors();
+        if (num_jobs > MAX_PARSE_THREADS) num_jobs = MAX_PARSE_THREADS;
+        if ((size_t)num_jobs > size / (PARALLEL_PARSE_MIN_BYTES / 4)) num_jobs = (int)(size / (PARALLEL_PARSE_MIN_BYTES / 4));
+    }
+#endif
+    ParseJob *jobs = calloc(num_jobs, sizeof(ParseJob));
+    if (jobs == NULL) {
+        outPrintf(out, "Memory allocation failed.\n");
+        return 1;
+    }
+
+    const char *end = data + size;
+    const char *chunk = data;
+    for (int i = 0; i < num_jobs; i++) {
+        const char *chunk_end = i == num_jobs - 1 ? end : data + size / num_jobs * (i + 1);
+        if (chunk_end < chunk) chunk_end = chunk;
+        // Move the cut to just after the next newline so no line is shared by two chunks
+        const char *newline = chunk_end < end ? memchr(chunk_end, '\n', end - chunk_end) : NULL;
+        if (i < num_jobs - 1) chunk_end = newline ? newline + 1 : end;
+
+        jobs[i].begin = chunk;
+        jobs[i].end = chunk_end;
+        Pool pool = POOL_INIT(StudentRecord, sizeof(void *));
+        Pool names[NAME_CLASSES] = NAME_HEAP_INIT;
+        jobs[i].pool = pool;
+        memcpy(jobs[i].names, names, sizeof(names));
+        chunk = chunk_end;
+    }
+
+#ifndef NO_THREADS
+    pthread_t threads[MAX_PARSE_THREADS];
+    bool started[MAX_PARSE_THREADS] = {false};
+    for (int i = 1; i < num_jobs; i++) {
+        started[i] = pthread_create(&threads[i], NULL, parseWorker, &jobs[i]) == 0;
+    }
+    parseRecords(&jobs[0]); // The calling thread takes the first chunk itself
+    for (int i = 1; i < num_jobs; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+        else {
+            parseRecords(&jobs[i]);
+        }
+    }
+#else
+    for (int i = 0; i < num_jobs; i++) {
+        parseRecords(&jobs[i]);
+    }
+#endif
+
+    int total = 0;
+    int line_base = 0;
+    bool out_of_memory = false;
+    for (int i = 0; i < num_jobs; i++) {
+        for (int e = 0; e < jobs[i].errors.count; e++) {
+            ParseError *error = &jobs[i].errors.errors[e];
+            errorAppend(errors, line_base + error->line, error->id, error->message);
+        }
+        line_base += jobs[i].num_lines;
+        total += jobs[i].batch.count;
+        out_of_memory = out_of_memory || jobs[i].out_of_memory;
+    }
+
+    *records = malloc((total ? total : 1) * sizeof(StudentRecord *));
+    *lines = malloc((total ? total : 1) * sizeof(int));
+    if (*records == NULL || *lines == NULL) out_of_memory = true;
+    *count = 0;
+    line_base = 0;
+    for (int i = 0; i < num_jobs; i++) {
+        if (!out_of_memory) {
+            memcpy(*records + *count, jobs[i].batch.records, jobs[i].batch.count * sizeof(StudentRecord *));
+            for (int j = 0; j < jobs[i].batch.count; j++) {
+                (*lines)[*count + j] = line_base + jobs[i].batch.lines[j];
+            }
+            *count += jobs[i].batch.count;
+            poolAdopt(&record_pool, &jobs[i].pool);
+            for (int c = 0; c < NAME_CLASSES; c++) poolAdopt(&name_heap[c], &jobs[i].names[c]);
+        }
+        else {
+            poolDestroy(&jobs[i].pool);
+            for (int c = 0; c < NAME_CLASSES; c++) poolDestroy(&jobs[i].names[c]);
+        }
+        line_base += jobs[i].num_lines;
+        free(jobs[i].batch.records);
+        free(jobs[i].batch.lines);
+        free(jobs[i].errors.errors);
+    }
+    free(jobs);
+
+    if (out_of_memory) {
+        outPrintf(out, "Memory allocation failed.\n");
+        free(*records);
+        free(*lines);
+        *records = NULL;
+        *lines = NULL;
+        return 1;
+    }
+    return 0;
+}
+
+/* ========== Binary snapshots ========== */
+
+/*
+ * Snapshot layout, every integer is little endian:
+ *   "CMSB" | u32 version | u32 record count | u32 reserved
+ *   per record, in ascending ID order: u32 id | u32 mark (float bits) | u8 name length | u8 programme length | name | programme
+ *   u64 checksum of every byte before it
+ */
+#define SNAPSHOT_MAGIC "CMSB"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_HEADER_SIZE 16
+#define SNAPSHOT_EXT ".bin" // SAVE writes a snapshot when the file name ends with this, CSV otherwise
+#define SNAPSHOT_BUFFER (1 << 20) // Must stay a multiple of 8, see checksumUpdate
+#define CHECKSUM_SEED 0xcbf29ce484222325ULL
+#define CHECKSUM_PRIME 0x100000001b3ULL
+
+void putU32(unsigned char *out, uint32_t value){
+    out[0] = (unsigned char)value;
+    out[1] = (unsigned char)(value >> 8);
+    out[2] = (unsigned char)(value >> 16);
+    out[3] = (unsigned char)(value >> 24);
+}
+
+uint32_t getU32(const unsigned char *in){
+    return (uint32_t)in[0] | (uint32_t)in[1] << 8 | (uint32_t)in[2] << 16 | (uint32_t)in[3] << 24;
+}
+
+uint64_t getU64(const unsigned char *in){
+    return (uint64_t)getU32(in) | (uint64_t)getU32(in + 4) << 32;
+}
+
+/*
+ * FNV-1a taken a 64 bit word at a time, with the tail done byte by byte.
+ * Feeding the data in pieces gives the same result as one call as long as every piece but the last is a multiple of 8 bytes.
+ */
+uint64_t checksumUpdate(uint64_t hash, const unsigned char *data, size_t len){
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8){
+        hash = (hash ^ getU64(data + i)) * CHECKSUM_PRIME;
+    }
+    for (; i < len; i++){
+        hash = (hash ^ data[i]) * CHECKSUM_PRIME;
+    }
+    return hash;
+}
+
+typedef struct SnapshotWriter {
+    FILE *file;
+    unsigned char *buffer;
+    size_t used;
+    uint64_t checksum; // Covers everything flushed so far
+    bool failed;
+} SnapshotWriter;
+
+void snapshotFlush(SnapshotWriter *writer){
+    writer->checksum = checksumUpdate(writer->checksum, writer->buffer, writer->used);
+    if (fwrite(writer->buffer, 1, writer->used, writer->file) != writer->used) writer->failed = true;
+    writer->used = 0;
+}
+
+void snapshotPut(SnapshotWriter *writer, const void *data, size_t len){
+    const unsigned char *bytes = data;
+    while (len > 0){
+        size_t room = SNAPSHOT_BUFFER - writer->used;
+        size_t n = len < room ? len : room;
+        memcpy(writer->buffer + writer->used, bytes, n);
+        writer->used += n;
+        bytes += n;
+        len -= n;
+        if (writer->used == SNAPSHOT_BUFFER) snapshotFlush(writer); // Only full buffers are flushed mid stream
+    }
+}
+
+/* Write records, already in ascending ID order, to file as a snapshot. Returns 1 on failure */
+int saveSnapshot(FILE *file, StudentRecord **records, int count){
+    SnapshotWriter writer = {file, malloc(SNAPSHOT_BUFFER), 0, CHECKSUM_SEED, false};
+    if (writer.buffer == NULL){
+        return 1;
+    }
+
+    unsigned char header[SNAPSHOT_HEADER_SIZE];
+    memcpy(header, SNAPSHOT_MAGIC, 4);
+    putU32(header + 4, SNAPSHOT_VERSION);
+    putU32(header + 8, (uint32_t)count);
+    putU32(header + 12, 0);
+    snapshotPut(&writer, header, sizeof(header));
+
+    for (int i = 0; i < count; i++){
+        RecordCopy copy;
+        StudentRecord *rec = viewRecord(records, i, &copy);
+        const char *programme = programmeText(rec->programme);
+        unsigned char fixed[10];
+        uint32_t mark_bits;
+        memcpy(&mark_bits, &rec->mark, sizeof(mark_bits));
+        size_t name_len = rec->name_len;
+        size_t programme_len = strlen(programme);
+        putU32(fixed, (uint32_t)rec->id);
+        putU32(fixed + 4, mark_bits);
+        fixed[8] = (unsigned char)name_len;
+        fixed[9] = (unsigned char)programme_len;
+        snapshotPut(&writer, fixed, sizeof(fixed));
+        snapshotPut(&writer, rec->name, name_len);
+        snapshotPut(&writer, programme, programme_len);
+    }
+    snapshotFlush(&writer);
+
+    unsigned char trailer[8];
+    putU32(trailer, (uint32_t)writer.checksum);
+    putU32(trailer + 4, (uint32_t)(writer.checksum >> 32));
+    if (fwrite(trailer, 1, sizeof(trailer), file) != sizeof(trailer)) writer.failed = true;
+
+    free(writer.buffer);
+    return writer.failed ? 1 : 0;
+}
+
+bool isSnapshot(const char *data, size_t size){
+    return size >= 4 && memcmp(data, SNAPSHOT_MAGIC, 4) == 0;
+}
+
+/* Read every record out of a mapped snapshot, returns 1 if the file is damaged or from another version */
+int loadSnapshot(const char *data, size_t size, StudentRecord ***records, int *count, OutBuffer *out){
+    const unsigned char *bytes = (const unsigned char *)data;
+    if (size < SNAPSHOT_HEADER_SIZE + 8){
+        outPrintf(out, "Snapshot file is truncated.\n");
+        return 1;
+    }
+    if (getU32(bytes + 4) != SNAPSHOT_VERSION){
+        outPrintf(out, "Unsupported snapshot version %u.\n", getU32(bytes + 4));
+        return 1;
+    }
+    if (checksumUpdate(CHECKSUM_SEED, bytes, size - 8) != getU64(bytes + size - 8)){
+        outPrintf(out, "Snapshot file is corrupt, checksum does not match.\n");
+        return 1;
+    }
+
+    uint32_t num_records = getU32(bytes + 8);
+    const unsigned char *p = bytes + SNAPSHOT_HEADER_SIZE;
+    const unsigned char *end = bytes + size - 8;
+    if (num_records > (size_t)(end - p) / 10){
+        outPrintf(out, "Snapshot file is corrupt.\n");
+        return 1;
+    }
+    *records = malloc((num_records ? num_records : 1) * sizeof(StudentRecord *));
+    if (*records == NULL){
+        outPrintf(out, "Memory allocation failed.\n");
+        return 1;
+    }
+
+    *count = 0;
+    const char *error = NULL;
+    ProgrammeCache programmes = {{0}, {0}};
+    for (uint32_t i = 0; i < num_records && error == NULL; i++){
+        if (end - p < 10){
+            error = "Snapshot file is corrupt.";
+            break;
+        }
+        int id = (int)getU32(p);
+        uint32_t mark_bits = getU32(p + 4);
+        float mark;
+        memcpy(&mark, &mark_bits, sizeof(mark));
+        size_t name_len = p[8];
+        size_t programme_len = p[9];
+        const char *name = (const char *)p + 10;
+        const char *programme = name + name_len;
+        if ((size_t)(end - p) < 10 + name_len + programme_len){
+            error = "Snapshot file is corrupt.";
+            break;
+        }
+        error = recordError(id, name, name_len, programme, programme_len, mark);
+        if (error == NULL){
+            (*records)[(*count)++] = createRecord(&record_pool, name_heap, id, name, name_len,
+                                                  programmeCached(&programmes, programme, programme_len), mark);
+        }
+        p += 10 + name_len + programme_len;
+    }
+    if (error != NULL){
+        outPrintf(out, "%s\n", error);
+        for (int i = 0; i < *count; i++) freeRecord((*records)[i]);
+        free(*records);
+        *records = NULL;
+        return 1;
+    }
+    return 0;
+}
+
+int input_open(BTreeNode **root, const char *filename, int *num_students, OutBuffer *out){
+    MappedFile mapped;
+    if (mapFile(filename, &mapped, out) == 1) {
+        return 1;
+    }
+
+    // Records are collected here and bulk loaded once the whole file is read
+    StudentRecord **records;
+    int *lines = NULL; // A snapshot has no lines
+    int count;
+    int result;
+    ErrorList errors = {NULL, 0, 0};
+    if (isSnapshot(mapped.data, mapped.size)) {
+        result = loadSnapshot(mapped.data, mapped.size, &records, &count, out);
+    }
+    else {
+        result = parseFile(mapped.data, mapped.size, &records, &lines, &count, &errors, out);
+    }
+    unmapFile(&mapped);
+    if (result == 1) {
+        printLoadErrors(&errors, out);
+        return 1;
+    }
+
+    result = bulkLoad(root, records, lines, count, num_students, &errors, out);
+    printLoadErrors(&errors, out);
+    free(records);
+    free(lines);
+    return result;
+
+}
+
+bool hasExtension(const char *filename, const char *ext){
+    size_t len = strlen(filename);
+    size_t ext_len = strlen(ext);
+    if (len < ext_len) return false;
+    for (size_t i = 0; i < ext_len; i++){
+        if (tolower((unsigned char)filename[len - ext_len + i]) != ext[i]) return false;
+    }
+    return true;
+}
+
+/* ========== Write-ahead log ========== */
+
+/*
+ * Every INSERT, UPDATE and DELETE is appended to <database file>.wal so it survives a crash without a SAVE.
+ * Log layout: "CMSW" | u32 version, then one entry per change:
+ *   u8 type | u32 id | u32 mark (float bits) | u8 name length | u8 programme length | name | programme | u32 checksum
+ * An upsert entry carries the whole record after the change, a delete entry only the id,
+ * so replaying an entry twice gives the same result as replaying it once.
+ * After WAL_CHECKPOINT_EVERY entries the database file is rewritten in the background and the log starts over.
+ */
+#define WAL_MAGIC "CMSW"
+#define WAL_VERSION 1
+#define WAL_EXT ".wal"
+#define WAL_OLD_EXT ".wal.old" // Log being folded into a checkpoint that has not finished yet
+#define WAL_UPSERT 'U'
+#define WAL_DELETE 'D'
+#define WAL_ENTRY_FIXED 11 // type, id, mark and the two lengths
+#ifndef WAL_SYNC_EVERY
+#define WAL_SYNC_EVERY 16 // fsync the log after this many entries, 1 makes every command durable before the prompt returns
+#endif
+#ifndef WAL_CHECKPOINT_EVERY
+#define WAL_CHECKPOINT_EVERY 10000
+#endif
+
+/* A full write of a database file on a background thread, for log checkpoints and SAVE */
+typedef struct Checkpoint {
+    FILE *file; // Temporary file, opened up front so a target that cannot be written fails straight away
+    char filename[256];
+    char old_log[272]; // Log folded into the file, removed once it is written. Empty for a SAVE to another file
+    ReadView view; // The records when the job started, the live tree keeps changing meanwhile
+    int result;
+#ifndef NO_THREADS
+    pthread_t thread;
+    bool threaded;
+#endif
+    bool running;
+    bool done; // Set by the worker once the file is written
+    bool announce; // Report a successful write, for SAVE
+    bool claimed; // A server client collects the result, checkpointPoll leaves the job to it
+    OutBuffer *log; // Where the result goes when no command is waiting on it
+    int failures; // Failed writes reported to the log and not yet counted by checkpointPoll
+} Checkpoint;
+
+typedef struct WriteAheadLog {
+    FILE *file;
+    char filename[256]; // Database file the log belongs to
+    char path[272];
+    int unsynced; // Entries written since the last fsync
+    int entries; // Entries since the last checkpoint
+    bool broken; // A write to it failed, changes since are only in memory until a checkpoint starts a new log
+    Checkpoint checkpoint;
+} WriteAheadLog;
+
+/* Push everything written to file down to the disk, returns 1 if it did not get there */
+int syncFile(FILE *file){
+    if (fflush(file) != 0) return 1;
+#ifdef _WIN32
+    return FlushFileBuffers((HANDLE)_get_osfhandle(_fileno(file))) ? 0 : 1;
+#else
+    return fsync(fileno(file)) == 0 ? 0 : 1;
+#endif
+}
+
+/* Rename tmp over target, replacing target if it exists */
+int replaceFile(const char *tmp, const char *target){
+#ifdef _WIN32
+    return MoveFileExA(tmp, target, MOVEFILE_REPLACE_EXISTING) ? 0 : 1;
+#else
+    return rename(tmp, target) == 0 ? 0 : 1;
+#endif
+}
+
+bool fileExists(const char *path){
+    FILE *probe = fopen(path, "rb");
+    if (probe == NULL) return false;
+    fclose(probe);
+    return true;
+}
+
+/* Open the temporary file a write of filename goes to, NULL if it cannot be created */
+FILE *openDatabaseTmp(const char *filename){
+    char tmp[272];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", filename);
+    return fopen(tmp, "wb");
+}
+
+/* Write records, read through viewRecord, to file from openDatabaseTmp and rename it over filename. Closes file. */
+int fillDatabaseFile(FILE *file, const char *filename, StudentRecord **records, int count){
+    char tmp[272];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", filename);
+    int result;
+    if (hasExtension(filename, SNAPSHOT_EXT)){
+        result = saveSnapshot(file, records, count);
+    }
+    else{
+        // CSV export
+        OutBuffer *out = outOpen(file, true);
+        if (out != NULL){
+            for (int i = 0; i < count; i++){
+                RecordCopy copy;
+                printRecord(viewRecord(records, i, &copy), out);
+            }
+            outFlush(out);
+            result = out->failed || ferror(file) ? 1 : 0;
+            free(out);
+        }
+        else{
+            result = 1;
+        }
+    }
+    if (syncFile(file) == 1) result = 1;
+    if (fclose(file) != 0) result = 1;
+    if (result == 0) result = replaceFile(tmp, filename);
+    if (result == 1) remove(tmp);
+    return result;
+}
+
+/* Write records to filename through a temporary file, so a crash never leaves a half written database */
+int writeDatabaseFile(const char *filename, StudentRecord **records, int count){
+    FILE *file = openDatabaseTmp(filename);
+    if (file == NULL){
+        return 1;
+    }
+    return fillDatabaseFile(file, filename, records, count);
+}
+
+/* Returns 1 if the entry did not make it into the log, which is then broken until the next checkpoint */
+int walWriteEntry(WriteAheadLog *wal, char type, int id, StudentRecord *rec, OutBuffer *out){
+    if (wal->file == NULL) return 0; // No log, OPEN already said changes are only kept by SAVE
+    if (wal->broken){
+        wal->entries++; // Still counts toward the checkpoint that starts a new log
+        outPrintf(out, "Log file %s cannot be written, SAVE to keep this change.\n", wal->path);
+        return 1;
+    }
+    unsigned char entry[WAL_ENTRY_FIXED + MAX_NAME + MAX_PROGRAMME + 4];
+    const char *programme = rec ? programmeText(rec->programme) : "";
+    size_t name_len = rec ? rec->name_len : 0;
+    size_t programme_len = strlen(programme);
+    uint32_t mark_bits = 0;
+    if (rec) memcpy(&mark_bits, &rec->mark, sizeof(mark_bits));
+
+    entry[0] = (unsigned char)type;
+    putU32(entry + 1, (uint32_t)id);
+    putU32(entry + 5, mark_bits);
+    entry[9] = (unsigned char)name_len;
+    entry[10] = (unsigned char)programme_len;
+    if (rec){
+        memcpy(entry + WAL_ENTRY_FIXED, rec->name, name_len);
+        memcpy(entry + WAL_ENTRY_FIXED + name_len, programme, programme_len);
+    }
+    size_t len = WAL_ENTRY_FIXED + name_len + programme_len;
+    putU32(entry + len, (uint32_t)checksumUpdate(CHECKSUM_SEED, entry, len));
+    len += 4;
+
+    // The fflush survives the process dying, the fsync below covers the machine dying
+    bool written = fwrite(entry, 1, len, wal->file) == len && fflush(wal->file) == 0;
+    wal->entries++;
+    if (written && ++wal->unsynced >= WAL_SYNC_EVERY){
+        written = syncFile(wal->file) == 0;
+        wal->unsynced = 0;
+    }
+    if (!written){
+        wal->broken = true;
+        outPrintf(out, "Log file %s cannot be written, SAVE to keep this change.\n", wal->path);
+        return 1;
+    }
+    return 0;
+}
+
+/* Log the current state of rec after it was inserted or updated */
+int walLogUpsert(WriteAheadLog *wal, StudentRecord *rec, OutBuffer *out){
+    return walWriteEntry(wal, WAL_UPSERT, rec->id, rec, out);
+}
+
+int walLogDelete(WriteAheadLog *wal, int id, OutBuffer *out){
+    return walWriteEntry(wal, WAL_DELETE, id, NULL, out);
+}
+
+/* Apply every intact entry of the log at path to the tree, returns the number applied */
+int walReplay(const char *path, BTreeNode **root, int *num_students, OutBuffer *out){
+    FILE *probe = fopen(path, "rb");
+    if (probe == NULL) return 0; // No log, nothing to replay
+    fclose(probe);
+
+    MappedFile mapped;
+    if (mapFile(path, &mapped, out) == 1) return 0;
+    const unsigned char *p = (const unsigned char *)mapped.data;
+    const unsigned char *end = p + mapped.size;
+    int applied = 0;
+
+    if (mapped.size < 8 || memcmp(p, WAL_MAGIC, 4) != 0 || getU32(p + 4) != WAL_VERSION){
+        if (mapped.size > 0) outPrintf(out, "Log file %s is not recognised, ignored.\n", path);
+        unmapFile(&mapped);
+        return 0;
+    }
+    p += 8;
+    while (p < end){
+        if (end - p < WAL_ENTRY_FIXED + 4) break;
+        size_t name_len = p[9];
+        size_t programme_len = p[10];
+        size_t len = WAL_ENTRY_FIXED + name_len + programme_len;
+        if ((size_t)(end - p) < len + 4 || getU32(p + len) != (uint32_t)checksumUpdate(CHECKSUM_SEED, p, len)) break;
+
+        int id = (int)getU32(p + 1);
+        if (p[0] == WAL_DELETE){
+            removeRecord(root, id, num_students);
+        }
+        else{
+            uint32_t mark_bits = getU32(p + 5);
+            float mark;
+            memcpy(&mark, &mark_bits, sizeof(mark));
+            const char *name = (const char *)p + WAL_ENTRY_FIXED;
+            const char *programme = name + name_len;
+            if (recordError(id, name, name_len, programme, programme_len, mark) == NULL){
+                StudentRecord *rec = searchIndex(*root, id);
+                if (rec == NULL){
+                    rec = createRecord(&record_pool, name_heap, id, name, name_len, programmeIntern(programme, programme_len), mark);
+                    insert(root, rec->id, rec);
+                    indexRecord(rec);
+                    *num_students += 1;
+                }
+                else{
+                    unindexRecord(rec); // Filed under the old programme and mark
+                    nameRelease(rec->name, rec->name_len);
+                    rec->name = nameStore(name_heap, name, name_len);
+                    rec->name_len = (uint8_t)name_len;
+                    rec->programme = programmeIntern(programme, programme_len);
+                    rec->mark = mark;
+                    indexRecord(rec);
+                }
+            }
+        }
+        applied++;
+        p += len + 4;
+    }
+    if (p < end){
+        outPrintf(out, "Log file %s ends with a damaged entry, the rest of it was ignored.\n", path);
+    }
+    unmapFile(&mapped);
+    return applied;
+}
+
+/* Start a fresh, empty log */
+void walCreate(WriteAheadLog *wal, OutBuffer *out){
+    wal->file = fopen(wal->path, "wb");
+    if (wal->file == NULL){
+        outPrintf(out, "Cannot open log file %s, changes will only be kept by SAVE.\n", wal->path);
+        return;
+    }
+    unsigned char header[8];
+    memcpy(header, WAL_MAGIC, 4);
+    putU32(header + 4, WAL_VERSION);
+    if (fwrite(header, 1, sizeof(header), wal->file) != sizeof(header) || syncFile(wal->file) == 1){
+        outPrintf(out, "Cannot write log file %s, changes will only be kept by SAVE.\n", wal->path);
+        fclose(wal->file);
+        wal->file = NULL;
+        return;
+    }
+    wal->unsynced = 0;
+    wal->entries = 0;
+    wal->broken = false;
+}
+
+/* Open the view and the temporary file for a write of filename, returns 1 if either cannot be had */
+int checkpointPrepare(Checkpoint *job, const char *filename, BTreeNode *root, int num_students){
+    snprintf(job->filename, sizeof(job->filename), "%s", filename);
+    job->announce = false;
+    if (viewOpen(&job->view, root, num_students) == 1) return 1;
+    job->file = openDatabaseTmp(filename);
+    if (job->file == NULL){
+        viewClose(&job->view);
+        return 1;
+    }
+    return 0;
+}
+
+/* Undo checkpointPrepare for a job that will not be started */
+void checkpointCancel(Checkpoint *job){
+    char tmp[272];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", job->filename);
+    fclose(job->file);
+    remove(tmp);
+    viewClose(&job->view);
+}
+
+void *checkpointWorker(void *arg){
+    Checkpoint *job = arg;
+    job->result = fillDatabaseFile(job->file, job->filename, job->view.records, job->view.count);
+    if (job->result == 0 && job->old_log[0] != '\0'){
+        remove(job->old_log); // Everything in it is now in the database file
+    }
+    __atomic_store_n(&job->done, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/* Run a prepared job, in the background when threads are available */
+void checkpointStart(Checkpoint *job){
+    job->running = true;
+    job->done = false;
+#ifndef NO_THREADS
+    job->threaded = pthread_create(&job->thread, NULL, checkpointWorker, job) == 0;
+    if (job->threaded) return;
+#endif
+    checkpointWorker(job);
+}
+
+/* Wait for the job and release its view, returns 1 if the file was not written */
+int checkpointFinish(Checkpoint *job, OutBuffer *out){
+    if (!job->running) return 0;
+#ifndef NO_THREADS
+    if (job->threaded) pthread_join(job->thread, NULL);
+#endif
+    job->running = false;
+    viewClose(&job->view);
+    if (job->result == 1){
+        if (job->old_log[0] != '\0'){
+            outPrintf(out, "Background checkpoint of \"%s\" failed, its changes are still in the log.\n", job->filename);
+        }
+        else{
+            outPrintf(out, "Background save of \"%s\" failed, the file cannot be written.\n", job->filename);
+        }
+    }
+    else if (job->announce){
+        note(out, "The database file \"%s\" is successfully saved.\n", job->filename);
+    }
+    return job->result;
+}
+
+/* Finish an earlier job, its result goes to the log and not to the command that had to wait for it */
+void checkpointSettle(Checkpoint *job){
+    if (job->running && checkpointFinish(job, job->log) == 1){
+        job->failures++;
+    }
+}
+
+/* Between commands, settle a job whose worker is done. Returns how many writes failed since the last call */
+int checkpointPoll(Checkpoint *job){
+    if (job->running && !job->claimed && __atomic_load_n(&job->done, __ATOMIC_ACQUIRE)){
+        checkpointSettle(job);
+    }
+    int failures = job->failures;
+    job->failures = 0;
+    return failures;
+}
+
+void checkpointWait(WriteAheadLog *wal){
+    checkpointSettle(&wal->checkpoint);
+}
+
+/* Detach from the current log, making sure everything in it is on disk */
+void walClose(WriteAheadLog *wal){
+    checkpointWait(wal);
+    if (wal->file != NULL){
+        syncFile(wal->file);
+        fclose(wal->file);
+        wal->file = NULL;
+    }
+}
+
+/*
+ * Attach the log to a database file, replaying whatever an earlier session left in it.
+ * Entries from a checkpoint that never finished are replayed before the current log.
+ */
+int walAttach(WriteAheadLog *wal, const char *filename, BTreeNode **root, int *num_students, OutBuffer *out){
+    walClose(wal);
+    snprintf(wal->filename, sizeof(wal->filename), "%s", filename);
+    snprintf(wal->path, sizeof(wal->path), "%s%s", filename, WAL_EXT);
+    snprintf(wal->checkpoint.old_log, sizeof(wal->checkpoint.old_log), "%s%s", filename, WAL_OLD_EXT);
+
+    int replayed = walReplay(wal->checkpoint.old_log, root, num_students, out);
+    replayed += walReplay(wal->path, root, num_students, out);
+
+    // Fold the replayed entries into the database file so both logs can start over
+    if (replayed > 0){
+        int count = 0;
+        StudentRecord **records = malloc((*num_students ? *num_students : 1) * sizeof(StudentRecord *));
+        int result = 1;
+        if (records != NULL){
+            collectRecords(*root, records, &count);
+            result = writeDatabaseFile(filename, records, count);
+            free(records);
+        }
+        if (result == 1){
+            // Keep the logs as they are and carry on appending to the current one
+            outPrintf(out, "Could not fold the log into \"%s\", it will be replayed again next time.\n", filename);
+            wal->file = fopen(wal->path, "ab");
+            wal->unsynced = 0;
+            wal->entries = 0;
+            wal->broken = false;
+            return replayed;
+        }
+    }
+    walCreate(wal, out);
+    remove(wal->checkpoint.old_log);
+    return replayed;
+}
+
+/*
+ * Fold the log into a full rewrite of the database file. Returns 1 if the rewrite could not be started.
+ * The current log is renamed aside and a new one started, then a read view of the records is written out on a background thread.
+ * A log still set aside by a checkpoint that failed is never renamed over: the database file lacks its changes,
+ * so that checkpoint is retried with the current log left in place. Its entries replay to the same records either way.
+ */
+int walCheckpoint(WriteAheadLog *wal, BTreeNode *root, int num_students, OutBuffer *out){
+    Checkpoint *checkpoint = &wal->checkpoint;
+    checkpointWait(wal);
+    if (wal->file == NULL) return 1;
+    if (checkpointPrepare(checkpoint, wal->filename, root, num_students) == 1){
+        wal->entries = 0; // Try again at the next checkpoint, the log still has everything
+        return 1;
+    }
+
+    if (syncFile(wal->file) == 1) wal->broken = true; // The checkpoint still has every change
+    if (fileExists(checkpoint->old_log)){
+        wal->entries = 0;
+        checkpointStart(checkpoint); // Removes the old log once the file is written, the current one carries on
+        return 0;
+    }
+    fclose(wal->file);
+    if (replaceFile(wal->path, checkpoint->old_log) == 1){
+        // The log still has everything, keep appending to it and try again at the next checkpoint
+        checkpointCancel(checkpoint);
+        wal->file = fopen(wal->path, "ab");
+        wal->entries = 0;
+        outPrintf(out, "Cannot set log file %s aside, the checkpoint was skipped.\n", wal->path);
+        if (wal->file == NULL){
+            outPrintf(out, "Cannot open log file %s, changes will only be kept by SAVE.\n", wal->path);
+        }
+        return 1;
+    }
+    walCreate(wal, out);
+    checkpointStart(checkpoint);
+    return 0;
+}
+
+/* Called after every logged change */
+void walMaybeCheckpoint(WriteAheadLog *wal, BTreeNode *root, int num_students, OutBuffer *out){
+    if (wal->entries >= WAL_CHECKPOINT_EVERY){
+        walCheckpoint(wal, root, num_students, out);
+    }
+}
+
+int input_save(BTreeNode *root, int num_students, const char* filename, OutBuffer *out){
+    // A .bin file gets a binary snapshot, anything else a CSV export
+    StudentRecord **records = malloc((num_students ? num_students : 1) * sizeof(StudentRecord *));
+    if (records == NULL){
+        outPrintf(out, "Memory allocation failed.\n");
+        return 1;
+    }
+    int count = 0;
+    collectRecords(root, records, &count);
+    int result = writeDatabaseFile(filename, records, count);
+    free(records);
+    if (result == 1){
+        outPrintf(out, "The file cannot be written.\n");
+        return 1;
+    }
+    note(out, "The database file \"%s\" is successfully saved.\n", filename);
+    return 0;
+}
+
+/* QUERY ID BETWEEN low AND high: one descent to low, then a forward scan until an id goes past high */
+int input_queryRange(BTreeNode *root, int low, int high, OutBuffer *out){
+    if (low > high){
+        outPrintf(out, "The first ID of the range must not be larger than the second.\n");
+        return 1;
+    }
+    int found = 0;
+    Cursor cursor;
+    cursorSeek(&cursor, high < 0 ? NULL : root, low < 0 ? 0 : (BTreeKey)low); // Ids are never negative
+    while (cursorRecord(&cursor) != NULL && cursorKey(&cursor) <= (BTreeKey)high){
+        if (found == 0) printHeader(out);
+        printRecord(cursorRecord(&cursor), out);
+        found++;
+        cursorNext(&cursor);
+    }
+    outFlush(out);
+    if (found == 0){
+        outPrintf(out, "No records found with ID between %d and %d.\n", low, high);
+    }
+    else{
+        outPrintf(out, "%d records found.\n", found);
+    }
+    return 0;
+}
+
+/* Cut a trailing "LIMIT n", "OFFSET m" or both off a SHOW ALL command, returns 1 if a number is missing or negative */
+int parsePaging(char *op, int *limit, int *offset){
+    char *limit_at = strstr(op, " limit ");
+    char *offset_at = strstr(op, " offset ");
+    *limit = -1;
+    *offset = 0;
+    if (limit_at != NULL && (sscanf(limit_at, " limit %d", limit) != 1 || *limit < 0)) return 1;
+    if (offset_at != NULL && (sscanf(offset_at, " offset %d", offset) != 1 || *offset < 0)) return 1;
+    if (limit_at != NULL) *limit_at = '\0';
+    if (offset_at != NULL) *offset_at = '\0';
+    return 0;
+}
+
+void input_showSorted(BTreeNode *root, char *sortby, char *order, int limit, int offset, OutBuffer *out){
+    bool isDescending = strcmp(order, "desc") == 0 ;
+    if (strcmp(sortby, "id") == 0){
+        printHeader(out);
+        showPage(root, isDescending, limit, offset, out);
+        outFlush(out);
+    }
+    else if (strcmp(sortby, "mark") == 0){
+        printHeader(out);
+        showPage(mark_index, isDescending, limit, offset, out); // Already in mark order, no sorting needed
+        outFlush(out);
+    }
+    else{
+        outPrintf(out, "Follow this format to sort the data: SHOW ALL SORT BY ID/MARK ASC/DESC.\n");
+    }
+}
+
+
+
+/* QUERY PROGRAMME=<programme>: the group's own tree lists its records by id */
+int input_queryProgramme(const char *programme, OutBuffer *out){
+    ProgrammeGroup *group = findProgramme(programme);
+    if (group == NULL){
+        outPrintf(out, "No records found with %s=%s.\n", PROGRAMME, programme);
+        return 1;
+    }
+    printHeader(out);
+    showPage(group->members, false, -1, 0, out);
+    outFlush(out);
+    outPrintf(out, "%d records found.\n", group->count);
+    return 0;
+}
+
+/* The k records that beat every other one offered, see beats. A binary heap with the weakest kept record on top */
+typedef struct TopHeap {
+    StudentRecord **records;
+    int count;
+    int k;
+    bool highest;
+} TopHeap;
+
+void topSiftDown(TopHeap *heap, int i){
+    while (1){
+        int weakest = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+        if (left < heap->count && beats(heap->records[weakest], heap->records[left], heap->highest)) weakest = left;
+        if (right < heap->count && beats(heap->records[weakest], heap->records[right], heap->highest)) weakest = right;
+        if (weakest == i) return;
+        StudentRecord *tmp = heap->records[i];
+        heap->records[i] = heap->records[weakest];
+        heap->records[weakest] = tmp;
+        i = weakest;
+    }
+}
+
+void topOffer(TopHeap *heap, StudentRecord *rec){
+    if (heap->count < heap->k){
+        int i = heap->count++;
+        heap->records[i] = rec;
+        while (i > 0 && beats(heap->records[(i - 1) / 2], heap->records[i], heap->highest)){
+            StudentRecord *tmp = heap->records[i];
+            heap->records[i] = heap->records[(i - 1) / 2];
+            heap->records[(i - 1) / 2] = tmp;
+            i = (i - 1) / 2;
+        }
+    }
+    else if (beats(rec, heap->records[0], heap->highest)){
+        heap->records[0] = rec;
+        topSiftDown(heap, 0);
+    }
+}
+
+/*
+ * SHOW TOP/BOTTOM <k> BY MARK [PROGRAMME=<programme>]: the k highest or lowest marks, ties to the lower id.
+ * Without a programme the mark index is walked in from its top or bottom end and the walk stops at the first mark
+ * past the weakest one kept, so only the k records and any ties with the last of them are looked at.
+ * With a programme every member of its group goes through the heap, O(m log k) for m members.
+ */
+int input_showTop(int k, bool highest, const char *programme, OutBuffer *out){
+    ProgrammeGroup *group = NULL;
+    if (programme != NULL){
+        group = findProgramme(programme);
+        if (group == NULL){
+            outPrintf(out, "No records found with %s=%s.\n", PROGRAMME, programme);
+            return 1;
+        }
+    }
+    int total = group != NULL ? group->count : treeSize(mark_index);
+    if (k > total) k = total;
+    TopHeap heap = {malloc((k ? k : 1) * sizeof(StudentRecord *)), 0, k, highest};
+    if (heap.records == NULL){
+        outPrintf(out, "Memory allocation failed.\n");
+        return 1;
+    }
+
+    Cursor cursor;
+    if (group != NULL){
+        for (cursorSeek(&cursor, group->members, 0); cursorRecord(&cursor) != NULL; cursorNext(&cursor)){
+            topOffer(&heap, cursorRecord(&cursor));
+        }
+    }
+    else{
+        cursorSeekRank(&cursor, mark_index, highest ? total - 1 : 0);
+        for (StudentRecord *rec; (rec = cursorRecord(&cursor)) != NULL; ){
+            if (heap.count == heap.k && rec->mark != heap.records[0]->mark) break; // Nothing further on can beat the weakest
+            topOffer(&heap, rec);
+            if (highest) cursorPrev(&cursor);
+            else cursorNext(&cursor);
+        }
+    }
+
+    // Taking the weakest off the top each time fills the array from the back, best first
+    int kept = heap.count;
+    while (heap.count > 1){
+        StudentRecord *weakest = heap.records[0];
+        heap.records[0] = heap.records[--heap.count];
+        heap.records[heap.count] = weakest;
+        topSiftDown(&heap, 0);
+    }
+    printHeader(out);
+    for (int i = 0; i < kept; i++){
+        printRecord(heap.records[i], out);
+    }
+    outFlush(out);
+    free(heap.records);
+    return 0;
+}
+
+/* Print every record in the subtree in name order, returns how many */
+int nameList(NameNode *node, OutBuffer *out){
+    if (node == NULL) return 0;
+    int found = nameList(node->lo, out);
+    for (NameEntry *entry = node->records; entry != NULL; entry = entry->next){
+        printRecord(entry->rec, out);
+        found++;
+    }
+    found += nameList(node->eq, out);
+    found += nameList(node->hi, out);
+    return found;
+}
+
+/* QUERY NAME=<prefix>: every student whose name starts with prefix, ignoring case, in name order */
+int input_queryName(const char *prefix, OutBuffer *out){
+    NameNode *node = findNamePrefix(prefix);
+    int found = 0;
+    if (node != NULL){
+        printHeader(out);
+        // The prefix node's own records and everything after it in the name, not its lo and hi siblings
+        for (NameEntry *entry = node->records; entry != NULL; entry = entry->next){
+            printRecord(entry->rec, out);
+            found++;
+        }
+        found += nameList(node->eq, out);
+        outFlush(out);
+    }
+    if (found == 0){
+        outPrintf(out, "No records found with a name starting with %s.\n", prefix);
+        return 1;
+    }
+    outPrintf(out, "%d records found.\n", found);
+    return 0;
+}
+
+int sortProgrammeName(const void* a, const void* b) {
+    const ProgrammeGroup* groupA = *(const ProgrammeGroup**)a;
+    const ProgrammeGroup* groupB = *(const ProgrammeGroup**)b;
+    return strcmp(groupA->name, groupB->name);
+}
+
+/* SHOW SUMMARY BY PROGRAMME, one line per group straight from its running aggregates */
+void input_showSummaryByProgramme(OutBuffer *out){
+    if (programme_index.num_groups == 0){
+        outPrintf(out, "No data found!\n");
+        return;
+    }
+    ProgrammeGroup **groups = malloc(programme_index.num_groups * sizeof(ProgrammeGroup *));
+    if (groups == NULL){
+        outPrintf(out, "Memory allocation failed.\n");
+        return;
+    }
+    int n = 0;
+    for (int i = 0; i < programme_index.num_buckets; i++){
+        for (ProgrammeGroup *group = programme_index.buckets[i]; group != NULL; group = group->next){
+            groups[n++] = group;
+        }
+    }
+    qsort(groups, n, sizeof(ProgrammeGroup *), sortProgrammeName);
+
+    outPrintf(out, "%-25s %-10s %-8s %-8s %-8s\n", PROGRAMME, "Students", "Average", "Highest", "Lowest");
+    for (int i = 0; i < n; i++){
+        outPrintf(out, "%-25s %-10d %-8.1f %-8.1f %-8.1f\n",
+            groups[i]->name,
+            groups[i]->count,
+            groups[i]->sum / groups[i]->count,
+            groups[i]->highest->mark,
+            groups[i]->lowest->mark
+        );
+    }
+    free(groups);
+}
+
+/* COUNT MARK BETWEEN low AND high, one pass over the mark column */
+void input_countMarks(float low, float high, OutBuffer *out){
+    int count = columnCountBetween(mark_column.marks, mark_column.count, low, high);
+    outPrintf(out, "%d students have a mark between %.1f and %.1f.\n", count, low, high);
+}
+
+#define HISTOGRAM_BINS 10
+
+/* SHOW HISTOGRAM, students per band of 10 marks with 100 counted in the top band */
+void input_showHistogram(OutBuffer *out){
+    if (mark_column.count == 0){
+        outPrintf(out, "No data found!\n");
+        return;
+    }
+    int bins[HISTOGRAM_BINS];
+    float width = (float)(MAX_MARK - MIN_MARK) / HISTOGRAM_BINS;
+    columnHistogram(mark_column.marks, mark_column.count, bins, HISTOGRAM_BINS, width);
+    outPrintf(out, "%-12s %s\n", MARK, "Students");
+    for (int i = 0; i < HISTOGRAM_BINS; i++){
+        char range[32];
+        snprintf(range, sizeof(range), "%g - %g", i * width, (i + 1) * width);
+        outPrintf(out, "%-12s %d\n", range, bins[i]);
+    }
+}
+
+/* Mark of the student at the given rank in ascending mark order, 0 being the lowest */
+float markAtRank(int rank){
+    Cursor cursor;
+    cursorSeekRank(&cursor, mark_index, rank);
+    return cursorRecord(&cursor)->mark;
+}
+
+/* SHOW PERCENTILE p, interpolating between the two marks either side when p falls between students */
+void input_showPercentile(float p, OutBuffer *out){
+    if (!(p >= 0 && p <= 100)){
+        outPrintf(out, "Please enter a percentile between 0-100\n");
+        return;
+    }
+    int total = treeSize(mark_index);
+    if (total == 0){
+        outPrintf(out, "No data found!\n");
+        return;
+    }
+    double position = p / 100.0 * (total - 1);
+    int below = (int)position;
+    double mark = markAtRank(below);
+    if (below + 1 < total){
+        mark += (markAtRank(below + 1) - mark) * (position - below);
+    }
+    outPrintf(out, "%g%% percentile mark: %.1f\n", p, mark);
+}
+
+void input_showMedian(OutBuffer *out){
+    int total = treeSize(mark_index);
+    if (total == 0){
+        outPrintf(out, "No data found!\n");
+        return;
+    }
+    double median = total % 2 ? markAtRank(total / 2) : ((double)markAtRank(total / 2 - 1) + markAtRank(total / 2)) / 2;
+    outPrintf(out, "Median Mark: %.1f\n", median);
+}
+
+/* QUERY RANK ID=<id>: 1 + the number of students with a strictly higher mark, so tied students share a rank */
+int input_queryRank(BTreeNode *root, int id, OutBuffer *out){
+    StudentRecord *rec = searchIndex(root, id);
+    if (rec == NULL){
+        outPrintf(out, "ID %d not found!\n", id);
+        return 1;
+    }
+    int total = treeSize(mark_index);
+    // Every key on this mark sorts below the one with the largest possible id
+    int not_higher = countBelow(mark_index, markKeyFor(rec->mark, -1));
+    outPrintf(out, "%s (ID %d) is ranked %d of %d with a mark of %.1f.\n", rec->name, id, total - not_higher + 1, total, rec->mark);
+    return 0;
+}
+
+/* Newton's method, saves linking libm for a single square root */
+double squareRoot(double x){
+    if (x <= 0) return 0;
+    double guess = x > 1 ? x : 1;
+    for (int i = 0; i < 64; i++){
+        double next = (guess + x / guess) / 2;
+        if (next >= guess) break;
+        guess = next;
+    }
+    return guess;
+}
+
+void input_showSummaryStatistics(OutBuffer *out){
+    // Everything comes from mark_stats and the ends of the mark index, nothing is traversed
+    if (mark_stats.count > 0){
+        double mean = mark_stats.sum / mark_stats.count;
+        double variance = mark_stats.sum_squares / mark_stats.count - mean * mean;
+        StudentRecord *lowest = lowerBound(mark_index, 0);
+        // Ties go to the lowest ID at either end, so look up the first record on the highest mark
+        StudentRecord *highest = lowerBound(mark_index, markKeyFor(lastRecord(mark_index)->mark, 0));
+
+        outPrintf(out, "Total Number of students: %d\n", mark_stats.count);
+        outPrintf(out, "Average Mark: %.1f\n", mean);
+        outPrintf(out, "Standard Deviation: %.1f\n", squareRoot(variance));
+        outPrintf(out, "Highest Mark: %.1f by Student %s\n", highest->mark, highest->name);
+        outPrintf(out, "Lowest Mark: %.1f by Student %s\n", lowest->mark, lowest->name);
+    }
+    else{
+        outPrintf(out, "No data found!\n");
+    }
+}
+
+#ifndef NO_STATS
+typedef struct TreeShape {
+    int height;
+    long long nodes;
+    long long keys;
+} TreeShape;
+
+void treeShape(BTreeNode *node, int depth, TreeShape *shape){
+    if (node == NULL) return;
+    if (depth > shape->height) shape->height = depth;
+    shape->nodes++;
+    shape->keys += node->num_keys;
+    if (!node->is_leaf){
+        for (int i = 0; i <= node->num_keys; i++) treeShape(node->children[i], depth + 1, shape);
+    }
+}
+
+void printTreeShape(const char *label, BTreeNode *root, OutBuffer *out){
+    TreeShape shape = {0, 0, 0};
+    treeShape(root, 1, &shape);
+    outPrintf(out, "%-11s height %d, %lld nodes, fill factor %.1f%%\n", label, shape.height, shape.nodes,
+           shape.nodes ? 100.0 * shape.keys / (shape.nodes * MAX_KEYS) : 0.0);
+}
+
+void printPool(const char *label, Pool *pool, OutBuffer *out){
+    outPrintf(out, "%-13s %12zu %12zu %12zu %12zu\n", label, pool->allocations, pool->frees,
+           pool->allocations - pool->frees, pool->slab_bytes);
+}
+
+/* Upper bound in microseconds of the bucket holding the p-th percentile command, never past the slowest one */
+double bucketPercentile(CommandStats *stats, int p){
+    unsigned long long rank = (stats->count * p + 99) / 100;
+    unsigned long long seen = 0;
+    int bucket = 0;
+    while (bucket < LATENCY_BUCKETS - 1 && (seen += stats->buckets[bucket]) < rank) bucket++;
+    double bound = (double)(1ULL << bucket);
+    return bound < stats->slowest * 1e6 ? bound : stats->slowest * 1e6;
+}
+
+/* SHOW STATS, everything counted since the program started. Percentiles are histogram bucket bounds */
+void input_showStats(BTreeNode *root, OutBuffer *out){
+    outPrintf(out, "%-8s %10s %8s %12s %10s %10s %10s %12s\n", "Command", "Count", "Failed", "Total ms", "Avg us", "p50 us", "p99 us", "Max us");
+    for (int i = 0; i < COMMAND_TYPES; i++){
+        CommandStats *stats = &counters.commands[i];
+        if (stats->count == 0) continue;
+        outPrintf(out, "%-8s %10llu %8llu %12.3f %10.1f %10.1f %10.1f %12.1f\n", command_names[i], stats->count, stats->failed,
+               stats->seconds * 1e3, stats->seconds * 1e6 / stats->count,
+               bucketPercentile(stats, 50), bucketPercentile(stats, 99), stats->slowest * 1e6);
+    }
+    outPrintf(out, "\nSearches: %llu, %.1f nodes visited per search\n", counters.searches,
+           counters.searches ? (double)counters.nodes_visited / counters.searches : 0.0);
+    outPrintf(out, "Node splits: %llu, merges: %llu, borrows: %llu\n", counters.splits, counters.merges, counters.borrows);
+    outPrintf(out, "Programme dictionary: %d spellings\n", programme_dictionary.num_codes);
+
+    outPrintf(out, "\n%-13s %12s %12s %12s %12s\n", "Pool", "Allocations", "Frees", "In use", "Slab bytes");
+    printPool("records", &record_pool, out);
+    for (int c = 0; c < NAME_CLASSES; c++){
+        char label[16];
+        snprintf(label, sizeof(label), "names %d", 16 << c);
+        printPool(label, &name_heap[c], out);
+    }
+    printPool("nodes", &node_pool, out);
+    printPool("name nodes", &name_node_pool, out);
+    printPool("name entries", &name_entry_pool, out);
+
+    outPrintf(out, "\n");
+    printTreeShape("ID index:", root, out);
+    printTreeShape("Mark index:", mark_index, out);
+}
+#endif
+
+int parse_insert(char *input,
+                  int *id,
+                  char *name,
+                  char *programme,
+                  char *mark)
+{
+    input = input + strlen("insert ");//Remove insert at the start of the string
+    char *token = strtok(input, " ");
+    char *key, *value;
+   
+    printf("token:%s\n", token);
+
+
+    while (token != NULL) {
+
+        key = strtok(token, "=");
+        value = strtok(NULL, "");
+        printf("key:%s\n", key);
+        printf("value:%s\n",value);
+
+        if (key && value) {
+            if (strcmp(key, "id") == 0) {
+                safe_atoi(value, id);
+                if (*id == -1){
+                    return 1;
+                }
+
+                printf("id:%s\n", value);
+                // strncpy(id, value, sizeof(id) - 1);
+            }
+            else if (strcmp(key, "name") == 0) {
+                printf("val1:%s\n", value);
+
+                strncpy(name, value, sizeof(name) - 1);
+            }
+            else if (strcmp(key, "programme") == 0) {
+                printf("val2:%s\n", value);
+
+                strncpy(programme, value, sizeof(programme) - 1);
+            }
+            else if (strcmp(key, "mark") == 0) {
+                printf("val3:%s\n", value);
+
+                strncpy(mark, value, sizeof(programme) - 1);
+            }
+        }
+
+        token = strtok(NULL, " ");
+    }
+    return 0;
+}
+
+// int input_insert(BTreeNode **root, int *id,int* num_students, char* name, char *programme, char *mark){
+
+//         char *endptr;
+
+//         float f = strtof(mark, &endptr);
+
+//         if (*endptr == '\0') {// string converted
+//             if (createAndInsert(root, *id, name, programme, f, num_students) == 1){
+//                 printf("Insertion failed!\n");
+//             }
+//         }
+//         else{
+            
+//             printf("Invalid Input!\n");
+//         }
+    
+
+// }
+
+int input_insert(BTreeNode **root, int id,int* num_students, FILE *in, OutBuffer *out){
+    // The fields follow on the next three lines of the same input, a script included
+    char name[MAX_NAME] = "";
+    char programme[MAX_PROGRAMME] = "";
+    char mark[6] = "";
+
+    note(out, "Name= ");
+    outFlush(out);
+    fgets(name, sizeof(name), in);
+    name[strcspn(name, "\n")] =  '\0';
+
+    note(out, "Programme= ");
+    outFlush(out);
+    fgets(programme, sizeof(programme), in);
+    programme[strcspn(programme, "\n")] =  '\0';
+
+    note(out, "Mark= ");
+    outFlush(out);
+    fgets(mark, sizeof(mark), in);
+    char *endPtr;
+    float f = strtof(mark, &endPtr);
+
+    if (*endPtr == '\n') {// string converted
+        if (createAndInsert(root, id, name, programme, f, num_students, out) == 1){
+            outPrintf(out, "Insertion failed!\n");
+            return 1;
+        }
+        return 0;
+    }
+    else{
+        outPrintf(out, "Marks are invalid!\n");
+        return 1;
+    }
+
+}
+
+void insertDataForTesting(BTreeNode **root, int * p_num_students, OutBuffer *out){
+    createAndInsert(root,
+                2502841,
+                "Alicia Tan",
+                "Computer Science",
+                72.5,
+            p_num_students, out);
+
+    createAndInsert(root,
+                    2509174,
+                    "Marcus Lim",
+                    "Information Security",
+                    64.0,
+                p_num_students, out);
+
+    createAndInsert(root,
+                    2505532,
+                    "Samantha Ong",
+                    "Data Analytics",
+                    81.0,
+                p_num_students, out);
+
+    createAndInsert(root,
+                    2503328,
+                    "Rahul Nair",
+                    "Software Engineering",
+                    49.5,
+                p_num_students, out);
+
+    createAndInsert(root,
+                    2507769,
+                    "Chloe Wong",
+                    "Business Analytics",
+                    90.0,
+                p_num_students, out);
+
+    createAndInsert(root,
+                    2504417,
+                    "Nicholas Lee",
+                    "Applied AI",
+                    58.0,
+                p_num_students, out);
+
+    createAndInsert(root,
+                    2506355,
+                    "Emily Chan",
+                    "Cybersecurity",
+                    73.0,
+                p_num_students, out);
+}
+
+
+
+/* ========== Benchmark ========== */
+#ifdef BENCHMARK // Build the benchmark with -DBENCHMARK, e.g. gcc -O2 -DBENCHMARK database.c -o benchmark
+
+#define BENCH_OPS 10000 // Timed point operations per phase
+#define ID_RANGE (MAX_ID - MIN_ID + 1)
+#define ID_STRIDE 7777777 // Shares no factor with ID_RANGE, so i -> i * ID_STRIDE mod ID_RANGE never repeats an id
+
+#ifdef _WIN32
+#define NULL_DEVICE "NUL"
+#else
+#define NULL_DEVICE "/dev/null"
+#endif
+
+const char *bench_first_names[] = {
+    "Alicia", "Rahul", "Nicholas", "Samantha", "Emily", "Marcus", "Wei Ling", "Hui Min", "Jun Jie", "Priya",
+    "Aisyah", "Daniel", "Sarah", "Kumar", "Zhi Hao", "Rachel", "Farhan", "Grace", "Ethan", "Nur Aini",
+    "Bryan", "Chloe", "Arjun", "Jia Hui", "Ryan", "Siti", "Joshua", "Mei Ling", "Darren", "Kavitha"
+};
+const char *bench_last_names[] = {
+    "Tan", "Nair", "Lee", "Ong", "Chan", "Lim", "Ng", "Goh", "Wong", "Teo",
+    "Koh", "Chua", "Yeo", "Sim", "Pillai", "Rahman", "Ismail", "Low", "Ho", "Menon"
+};
+const char *bench_programmes[] = {
+    "Computer Science", "Software Engineering", "Applied AI", "Data Analytics",
+    "Cybersecurity", "Information Security", "Digital Supply Chain", "Interactive Media"
+};
+#define COUNT_OF(array) ((int)(sizeof(array) / sizeof(array[0])))
+
+/* xorshift64, the same seed always gives the same dataset and the same operation order */
+uint64_t benchRandom(uint64_t *state){
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+/* The i-th id of a synthetic dataset, distinct for every i below ID_RANGE */
+int syntheticId(long long i){
+    return MIN_ID + (int)((i * ID_STRIDE + 1234567) % ID_RANGE);
+}
+
+void syntheticRecord(uint64_t *state, char *name, char *programme, float *mark){
+    sprintf(name, "%s %s", bench_first_names[benchRandom(state) % COUNT_OF(bench_first_names)],
+            bench_last_names[benchRandom(state) % COUNT_OF(bench_last_names)]);
+    strcpy(programme, bench_programmes[benchRandom(state) % COUNT_OF(bench_programmes)]);
+    // Average of two rolls, marks bunch up around 50 like a real cohort
+    int tenths = (int)((benchRandom(state) % 1001 + benchRandom(state) % 1001) / 2);
+    *mark = tenths / 10.0f;
+}
+
+/* Writes rows records in the P2_1-CMS.txt format */
+int generateDataset(const char *filename, int rows){
+    if (rows < 0 || rows > ID_RANGE){
+        printf("Rows must be between 0 and %d.\n", ID_RANGE);
+        return 1;
+    }
+    FILE *file = fopen(filename, "w");
+    if (file == NULL){
+        printf("The file cannot be written.\n");
+        return 1;
+    }
+    setvbuf(file, NULL, _IOFBF, OUT_BUFFER_SIZE);
+    uint64_t state = 88172645463325252ULL;
+    char name[MAX_NAME];
+    char programme[MAX_PROGRAMME];
+    float mark;
+    for (int i = 0; i < rows; i++){
+        syntheticRecord(&state, name, programme, &mark);
+        fprintf(file, "%d,%s,%s,%.1f\n", syntheticId(i), name, programme, mark);
+    }
+    return fclose(file) == 0 ? 0 : 1;
+}
+
+int compareSeconds(const void *a, const void *b){
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* One JSON line per phase: throughput over the whole phase, nearest rank p50/p99 over single operations */
+void benchReport(FILE *report, int rows, const char *phase, double *samples, int ops){
+    double total = 0;
+    for (int i = 0; i < ops; i++) total += samples[i];
+    qsort(samples, ops, sizeof(double), compareSeconds);
+    fprintf(report, "{\"rows\":%d,\"op\":\"%s\",\"ops\":%d,\"seconds\":%.6f,\"ops_per_sec\":%.1f,"
+            "\"p50_us\":%.3f,\"p99_us\":%.3f}\n",
+            rows, phase, ops, total, total > 0 ? ops / total : 0,
+            samples[(ops * 50 + 99) / 100 - 1] * 1e6, samples[(ops * 99 + 99) / 100 - 1] * 1e6);
+    fflush(report);
+}
+
+/* Times every command against one synthetic table of the given size */
+int benchRun(FILE *report, int rows, double *samples){
+    const char *data_file = "benchmark-data.txt";
+    const char *csv_file = "benchmark-save.txt";
+    const char *bin_file = "benchmark-save.bin";
+    BTreeNode *root = NULL;
+    int num_students = 0;
+    uint64_t state = 0x9E3779B97F4A7C15ULL ^ (uint64_t)rows;
+    int reps = rows >= 1000000 ? 3 : 10; // Whole table operations
+    char name[MAX_NAME];
+    char programme[MAX_PROGRAMME];
+    char value[16];
+    float mark;
+    double start;
+    int result = 0;
+
+    if (generateDataset(data_file, rows) == 1) return 1;
+
+    // Commands print what they would at the prompt, into the null device so the report is all that is left
+    FILE *sink = fopen(NULL_DEVICE, "w");
+    OutBuffer *out = sink ? outOpen(sink, false) : NULL;
+    if (out == NULL){
+        if (sink) fclose(sink);
+        remove(data_file);
+        return 1;
+    }
+
+    for (int i = 0; i < reps && result == 0; i++){
+        start = nowSeconds();
+        result = input_open(&root, data_file, &num_students, out);
+        samples[i] = nowSeconds() - start;
+    }
+    if (result == 1 || num_students != rows){
+        fprintf(stderr, "Opening went wrong\n");
+        destroyDatabase(&root, &num_students);
+        free(out);
+        fclose(sink);
+        return 1;
+    }
+    benchReport(report, rows, "open", samples, reps);
+
+    for (int i = 0; i < BENCH_OPS; i++){
+        int id = syntheticId(benchRandom(&state) % rows);
+        RecordCopy rec;
+        start = nowSeconds();
+        unsigned long long visited = 0;
+        int found = searchIndexShared(&root, id, &rec, &visited); // What QUERY ID= runs
+        samples[i] = nowSeconds() - start;
+        if (!found) result = 1;
+    }
+    benchReport(report, rows, "query", samples, BENCH_OPS);
+
+    // New ids come from past the end of the dataset, so none of them collide
+    for (int i = 0; i < BENCH_OPS; i++){
+        int id = syntheticId((long long)rows + i);
+        syntheticRecord(&state, name, programme, &mark);
+        start = nowSeconds();
+        result |= createAndInsert(&root, id, name, programme, mark, &num_students, out);
+        samples[i] = nowSeconds() - start;
+    }
+    benchReport(report, rows, "insert", samples, BENCH_OPS);
+
+    for (int i = 0; i < BENCH_OPS; i++){
+        int id = syntheticId(benchRandom(&state) % rows);
+        sprintf(value, "%.1f", (benchRandom(&state) % 1001) / 10.0);
+        start = nowSeconds();
+        result |= updateStudentRecord(root, id, "mark", value, out);
+        samples[i] = nowSeconds() - start;
+    }
+    benchReport(report, rows, "update", samples, BENCH_OPS);
+
+    for (int i = 0; i < BENCH_OPS; i++){
+        int id = syntheticId((long long)rows + i);
+        start = nowSeconds();
+        result |= deleteKey(&root, id, &num_students, out);
+        samples[i] = nowSeconds() - start;
+    }
+    benchReport(report, rows, "delete", samples, BENCH_OPS);
+
+    for (int i = 0; i < reps; i++){
+        start = nowSeconds();
+        input_showSorted(root, "mark", "asc", -1, 0, out);
+        samples[i] = nowSeconds() - start;
+    }
+    benchReport(report, rows, "sort_mark", samples, reps);
+
+    for (int i = 0; i < BENCH_OPS; i++){
+        start = nowSeconds();
+        input_showSummaryStatistics(out);
+        samples[i] = nowSeconds() - start;
+    }
+    benchReport(report, rows, "summary", samples, BENCH_OPS);
+
+    for (int i = 0; i < reps; i++){
+        start = nowSeconds();
+        result |= input_save(root, num_students, csv_file, out);
+        samples[i] = nowSeconds() - start;
+    }
+    benchReport(report, rows, "save", samples, reps);
+
+    for (int i = 0; i < reps; i++){
+        start = nowSeconds();
+        result |= input_save(root, num_students, bin_file, out);
+        samples[i] = nowSeconds() - start;
+    }
+    benchReport(report, rows, "save_snapshot", samples, reps);
+
+    destroyDatabase(&root, &num_students);
+    outFlush(out);
+    free(out);
+    fclose(sink);
+    remove(data_file);
+    remove(csv_file);
+    remove(bin_file);
+    return result;
+}
+
+/* database --benchmark [<max rows>] [<report>], runs 10^3, 10^4, ... rows up to max rows */
+int benchmark(int max_rows, const char *report_file){
+    if (max_rows < 1){
+        printf("Max rows must be at least 1.\n");
+        return 1;
+    }
+    FILE *report = fopen(report_file, "w");
+    double *samples = malloc(BENCH_OPS * sizeof(double));
+    if (report == NULL || samples == NULL){
+        printf("Cannot write report %s.\n", report_file);
+        if (report) fclose(report);
+        free(samples);
+        return 1;
+    }
+    // Inserts need BENCH_OPS unused ids on top of the table
+    if (max_rows > ID_RANGE - BENCH_OPS) max_rows = ID_RANGE - BENCH_OPS;
+
+    batch_mode = true; // Timed as in a script, without the success messages
+    int result = 0;
+    for (long long size = 1000; result == 0; size *= 10){
+        int rows = size > max_rows ? max_rows : (int)size;
+        fprintf(stderr, "Benchmarking %d rows\n", rows);
+        result = benchRun(report, rows, samples);
+        if (rows == max_rows) break;
+    }
+    if (result != 0) fprintf(stderr, "Benchmark failed.\n");
+    fclose(report);
+    free(samples);
+    return result;
+}
+
+#ifndef NO_THREADS
+/*
+ * database --stress [<readers>] [<changes>] checks the concurrent read path: reader threads run what QUERY ID=
+ * runs while this thread inserts, deletes, renames and re-marks records, and every copy a reader gets is checked.
+ * Even ids stay in the table throughout, odd ones come and go.
+ */
+#define STRESS_IDS 20000
+#define STRESS_MAX_READERS 64
+
+const char *stress_names[] = {"Alicia Tan", "Nicholas Lee Wei Ming", "Ng"}; // Different lengths, a torn copy shows
+
+/*
+ * One of stress_names followed by letters spelling out k, the index of the record's id. Thousands of records
+ * sharing three names would leave the writer walking the name index's lists instead of changing the tree.
+ */
+void stressName(char *name, int variant, int k){
+    int len = sprintf(name, "%s ", stress_names[variant]);
+    do {
+        name[len++] = 'a' + k % 26;
+        k /= 26;
+    } while (k > 0);
+    name[len] = '\0';
+}
+
+typedef struct StressReader {
+    BTreeNode **root;
+    bool *stop;
+    uint16_t stable; // Programme of the even ids
+    uint16_t churn; // Programme of the odd ones
+    uint64_t state;
+    unsigned long long reads;
+    unsigned long long nodes_visited;
+    const char *error; // First wrong copy, NULL if there was none
+    int error_id;
+    pthread_t thread;
+} StressReader;
+
+bool stressKnownName(const char *name, int k){
+    char expected[MAX_NAME];
+    for (int i = 0; i < COUNT_OF(stress_names); i++){
+        stressName(expected, i, k);
+        if (strcmp(name, expected) == 0) return true;
+    }
+    return false;
+}
+
+void *stressWorker(void *arg){
+    StressReader *reader = arg;
+    RecordCopy copy;
+    while (reader->error == NULL && !__atomic_load_n(reader->stop, __ATOMIC_ACQUIRE)){
+        uint64_t r = benchRandom(&reader->state);
+        bool stable = r & 1;
+        int k = (int)((r >> 8) % STRESS_IDS);
+        int id = MIN_ID + k * 2 + (stable ? 0 : 1);
+        int found = searchIndexShared(reader->root, id, &copy, &reader->nodes_visited);
+        reader->reads++;
+        if (!found){
+            if (stable) reader->error = "a record that is never deleted was not found";
+        }
+        else if (copy.rec.id != id) reader->error = "the copy has another record's id";
+        else if (copy.rec.programme != (stable ? reader->stable : reader->churn)) reader->error = "the copy has another record's programme";
+        else if (!stressKnownName(copy.name, k)) reader->error = "the copy has a torn name";
+        else if (!(copy.rec.mark >= 0 && copy.rec.mark <= 100)) reader->error = "the copy has a torn mark";
+        if (reader->error != NULL) reader->error_id = id;
+    }
+    return NULL;
+}
+
+int stressTest(int reader_count, int changes){
+    if (reader_count < 1 || reader_count > STRESS_MAX_READERS || changes < 0){
+        printf("Readers must be between 1 and %d, changes at least 0.\n", STRESS_MAX_READERS);
+        return 1;
+    }
+    FILE *sink = fopen(NULL_DEVICE, "w");
+    OutBuffer *out = sink != NULL ? outOpen(sink, false) : NULL;
+    if (out == NULL){
+        printf("Cannot open %s.\n", NULL_DEVICE);
+        if (sink != NULL) fclose(sink);
+        return 1;
+    }
+    batch_mode = true;
+    BTreeNode *root = NULL;
+    int num_students = 0;
+    int result = 0;
+    char name[MAX_NAME];
+    for (int i = 0; i < STRESS_IDS; i++){
+        stressName(name, 0, i);
+        result |= createAndInsert(&root, MIN_ID + i * 2, name, (char *)bench_programmes[0], 50, &num_students, out);
+    }
+
+    bool stop = false;
+    StressReader readers[STRESS_MAX_READERS] = {0};
+    int started = 0;
+    while (result == 0 && started < reader_count){
+        StressReader *reader = &readers[started];
+        reader->root = &root;
+        reader->stop = &stop;
+        reader->stable = programmeIntern(bench_programmes[0], strlen(bench_programmes[0]));
+        reader->churn = programmeIntern(bench_programmes[1], strlen(bench_programmes[1]));
+        reader->state = 0x9E3779B97F4A7C15ULL * (started + 1);
+        if (pthread_create(&reader->thread, NULL, stressWorker, reader) != 0){
+            printf("Cannot start reader %d.\n", started + 1);
+            result = 1;
+            break;
+        }
+        started++;
+    }
+
+    uint64_t state = 88172645463325252ULL;
+    char value[16];
+    double start = nowSeconds();
+    for (int i = 0; result == 0 && i < changes; i++){
+        uint64_t r = benchRandom(&state);
+        int k = (int)((r >> 8) % STRESS_IDS);
+        switch ((r >> 40) % 4){
+        case 0:
+            // Fails when the id is already in, that is part of the mix
+            stressName(name, k % 3, k);
+            createAndInsert(&root, MIN_ID + k * 2 + 1, name, (char *)bench_programmes[1], 10, &num_students, out);
+            break;
+        case 1:
+            removeRecord(&root, MIN_ID + k * 2 + 1, &num_students);
+            break;
+        case 2:
+            stressName(name, (r >> 50) % 3, k);
+            updateStudentRecord(root, MIN_ID + k * 2, "name", name, out);
+            break;
+        default:
+            sprintf(value, "%.1f", (int)((r >> 20) % 1001) / 10.0);
+            updateStudentRecord(root, MIN_ID + k * 2, "mark", value, out);
+        }
+    }
+    double seconds = nowSeconds() - start;
+    __atomic_store_n(&stop, true, __ATOMIC_RELEASE);
+
+    unsigned long long reads = 0;
+    unsigned long long nodes_visited = 0;
+    for (int i = 0; i < started; i++){
+        pthread_join(readers[i].thread, NULL);
+        reads += readers[i].reads;
+        nodes_visited += readers[i].nodes_visited;
+        if (readers[i].error != NULL){
+            printf("Reader %d, ID %d: %s.\n", i + 1, readers[i].error_id, readers[i].error);
+            result = 1;
+        }
+    }
+    printf("%d readers made %llu reads, %.1f nodes visited per read, alongside %d changes in %.2f seconds.\n",
+           started, reads, reads ? (double)nodes_visited / reads : 0.0, changes, seconds);
+    if (result != 0) printf("Stress test failed.\n");
+
+    destroyDatabase(&root, &num_students);
+    free(out);
+    fclose(sink);
+    return result;
+}
+#endif
+#endif
+
+
+/* Tally printed when a script finishes */
+void batchTally(int commands, int failed){
+    printf("Ran %d commands, %d failed.\n", commands, failed);
+}
+
+/* Everything the commands work on, the prompt, scripts and server clients all share one */
+typedef struct Database {
+    BTreeNode *root;
+    int num_students;
+    char filename[256];
+    WriteAheadLog wal; // Attached to the database file by OPEN
+    Checkpoint save; // Background SAVE to a file other than the logged one
+    bool defer_saves; // Server mode, SAVE returns as soon as its write is started and leaves it in started_save
+    Checkpoint *started_save; // For the server to answer the SAVE once the write is done
+} Database;
+
+/* What QUERY ID= prints, rec is NULL if the id was not found. Returns 1 if it was not */
+int printQueryId(int id, RecordCopy *rec, OutBuffer *out){
+    if (rec == NULL){
+        outPrintf(out, "ID %d not found!\n", id);
+        return 1;
+    }
+    printHeader(out);
+    printRecord(&rec->rec, out);
+    outFlush(out);
+    return 0;
+}
+
+/* Runs one command line, op lowered and raw as typed. INSERT reads its fields from in. Returns 1 if the command failed */
+int runCommand(Database *db, char *op, char *raw, OutBuffer *console, FILE *in){
+    int status = 0; // Set to 1 by any command that fails
+    int id;
+
+    // LIMIT and OFFSET can follow any SHOW ALL, they are cut off before the command is matched
+    int limit = -1;
+    int offset = 0;
+    if (strncmp(op, "show all", 8) == 0 && parsePaging(op, &limit, &offset) == 1) {
+        outPrintf(console, "Follow this format to page through records: SHOW ALL ... LIMIT <n> OFFSET <m>.\n");
+        status = 1;
+    }
+    // // OPEN [<file>]
+    else if (strcmp(op, "open") == 0 || strncmp(op, "open ", 5) == 0) {
+        // The current file stays the SAVE default until the new one has loaded
+        char target[256];
+        strcpy(target, db->filename);
+        if (op[4] == ' ') {
+            sscanf(raw + 5, "%255s", target);
+        }
+        checkpointSettle(&db->save); // Background writes still read records that loading frees
+        checkpointWait(&db->wal);
+        int open_results = input_open(&db->root, target, &db->num_students, console);
+        if (open_results != 1){
+            strcpy(db->filename, target);
+            int replayed = walAttach(&db->wal, db->filename, &db->root, &db->num_students, console);
+            if (replayed > 0){
+                note(console, "Recovered %d logged changes.\n", replayed);
+            }
+        }
+        if(db->num_students != 0 && open_results != 1){
+            note(console, "The database file \"%s\" is successfully opened.\n", db->filename);
+        }
+        else{
+            outPrintf(console, "Opening went wrong\n");
+            status = 1;
+        }
+    }
+    // SAVE [<file>], a .bin file gets a binary snapshot, anything else a CSV export
+    else if (strcmp(op, "save") == 0 || strncmp(op, "save ", 5) == 0) {
+        char target[256];
+        strcpy(target, db->filename);
+        if (op[4] == ' ') {
+            sscanf(raw + 5, "%255s", target);
+        }
+        // Written from a read view on a background thread, commands carry on meanwhile
+        Checkpoint *job;
+        if (db->wal.file != NULL && strcmp(target, db->wal.filename) == 0){
+            // Saving the logged file folds the log into it, the same as a checkpoint
+            job = &db->wal.checkpoint;
+            status = walCheckpoint(&db->wal, db->root, db->num_students, console);
+        }
+        else{
+            job = &db->save;
+            checkpointSettle(job); // One SAVE at a time
+            if (strcmp(target, db->wal.filename) == 0){
+                checkpointWait(&db->wal); // A background checkpoint may be writing the same file
+            }
+            status = checkpointPrepare(job, target, db->root, db->num_students);
+            if (status == 0) checkpointStart(job);
+        }
+        if (status == 1){
+            outPrintf(console, "The file cannot be written.\n");
+        }
+        else{
+            job->announce = true;
+            // A script gets the real result before its next command, a client once the write is done while other
+            // clients carry on, and at the prompt it is reported whenever the write is done
+            if (db->defer_saves) db->started_save = job;
+            else if (batch_mode) status = checkpointFinish(job, console);
+        }
+    }
+    // SHOW ALL
+    else if (strcmp(op, "show all") == 0) {
+        note(console, "Here are all the records found in StudentRecords \n");
+        printHeader(console);
+        showPage(db->root, false, limit, offset, console);
+        outFlush(console);
+        // showAllById(db->root, false);
+    }
+    // SHOW ALL SORTED
+    else if (strstr(op, "show all sort") != NULL) {
+        char sortby[10];
+        char order[10];
+        if (sscanf(op, "show all sort by %s %s", sortby, order) == 2 
+            && ((strcmp(order, "desc") == 0) || (strcmp(order, "asc") == 0))){
+            input_showSorted(db->root, sortby, order, limit, offset, console);
+        }
+        else {
+            outPrintf(console, "Follow this format to sort the data: SHOW ALL SORT BY ID/MARK ASC/DESC [LIMIT <n>] [OFFSET <m>].\n");
+            status = 1;
+        }
+    }
+    // SHOW TOP/BOTTOM <k> BY MARK [PROGRAMME=<programme>]
+    else if (strncmp(op, "show top ", 9) == 0 || strncmp(op, "show bottom ", 12) == 0) {
+        bool highest = op[5] == 't';
+        const char *rest = op + (highest ? 9 : 12);
+        char programme[MAX_PROGRAMME] = "";
+        int k;
+        int end = 0;
+        if (sscanf(rest, "%d by mark%n", &k, &end) == 1 && end > 0 && k > 0
+            && (rest[end] == '\0' || sscanf(rest + end, " programme=%99[^\n]", programme) == 1)) {
+            status = input_showTop(k, highest, programme[0] != '\0' ? programme : NULL, console);
+        }
+        else {
+            outPrintf(console, "Follow this format to list the best or worst marks: SHOW TOP/BOTTOM <k> BY MARK [PROGRAMME=<PROGRAMME>].\n");
+            status = 1;
+        }
+    }
+    
+    // INSERT
+    else if (strstr(op, "insert") != NULL) {
+        if (sscanf(op, "insert id=%d", &id) == 1) {
+
+        status = input_insert(&db->root, id, &db->num_students, in, console);
+        if (status == 0){
+            status = walLogUpsert(&db->wal, searchIndex(db->root, id), console);
+            walMaybeCheckpoint(&db->wal, db->root, db->num_students, console);
+        }
+        }
+        else {
+            outPrintf(console, "Follow this format to insert: INSERT ID=<ID NUMBER>.\n");
+            status = 1;
+        }
+    }
+
+   
+    // QUERY
+    else if (strstr(op, "query") != NULL) {
+        int high;
+        char programme[MAX_PROGRAMME];
+        if (sscanf(op, "query id between %d and %d", &id, &high) == 2) {
+            status = input_queryRange(db->root, id, high, console);
+        }
+        else if (sscanf(op, "query rank id=%d", &id) == 1) {
+            status = input_queryRank(db->root, id, console);
+        }
+        else if (sscanf(op, "query programme=%99[^\n]", programme) == 1) {
+            status = input_queryProgramme(programme, console);
+        }
+        else if (sscanf(op, "query name=%99[^\n]", programme) == 1) {
+            status = input_queryName(programme, console);
+        }
+        else if (sscanf(op, "query id=%d", &id) == 1) {
+            RecordCopy rec;
+            unsigned long long visited = 0;
+            int found = searchIndexShared(&db->root, id, &rec, &visited);
+            STAT(counters.searches++; counters.nodes_visited += visited);
+            status = printQueryId(id, found ? &rec : NULL, console);
+        }
+        else {
+            outPrintf(console, "Follow this format to make a query: QUERY ID=<ID NUMBER>, QUERY ID BETWEEN <ID NUMBER> AND <ID NUMBER>, QUERY PROGRAMME=<PROGRAMME>, QUERY NAME=<START OF NAME> or QUERY RANK ID=<ID NUMBER>.\n");
+            status = 1;
+        }
+    }
+    // UPDATE
+    else if (strstr(op, "update") != NULL) {
+        char field[MAX_PROGRAMME];
+        char value[MAX_PROGRAMME];
+        if (sscanf(op, "update id=%d %[^=]=%[^\n]", &id, field, value) == 3) {
+            status = updateStudentRecord(db->root, id, field, value, console);
+            if (status == 0){
+                status = walLogUpsert(&db->wal, searchIndex(db->root, id), console);
+                walMaybeCheckpoint(&db->wal, db->root, db->num_students, console);
+            }
+        }
+        else {
+            outPrintf(console, "Follow this format to update: UPDATE ID=<ID Number> <Field>=<Value>.\nExample: UPDATE ID=2801234 MARK=98.7\n.");
+            status = 1;
+        }
+    }
+    // DELETE
+    else if (strstr(op, "delete") != NULL) {
+        if (sscanf(op, "delete id=%d", &id) == 1) {
+            status = deleteKey(&db->root, id, &db->num_students, console);
+            if (status == 0){
+                status = walLogDelete(&db->wal, id, console);
+                walMaybeCheckpoint(&db->wal, db->root, db->num_students, console);
+            }
+        }
+        else {
+            outPrintf(console, "Follow this format to delete data: DELETE ID=<ID NUMBER>.\n");
+            status = 1;
+        }
+    }
+    // SUMMARY
+    else if (strcmp(op, "show summary") == 0) {
+       input_showSummaryStatistics(console);
+    }
+    else if (strcmp(op, "show summary by programme") == 0) {
+       input_showSummaryByProgramme(console);
+    }
+    else if (strcmp(op, "show histogram") == 0) {
+       input_showHistogram(console);
+    }
+    else if (strcmp(op, "show median") == 0) {
+       input_showMedian(console);
+    }
+    else if (strcmp(op, "show stats") == 0) {
+#ifndef NO_STATS
+       input_showStats(db->root, console);
+#else
+       outPrintf(console, "This build has no statistics, it was compiled with NO_STATS.\n");
+       status = 1;
+#endif
+    }
+    // SHOW PERCENTILE <p>
+    else if (strncmp(op, "show percentile", 15) == 0) {
+        float p;
+        if (sscanf(op, "show percentile %f", &p) == 1) {
+            input_showPercentile(p, console);
+        }
+        else {
+            outPrintf(console, "Follow this format to get a percentile: SHOW PERCENTILE <0-100>.\n");
+            status = 1;
+        }
+    }
+    // COUNT MARK BETWEEN <low> AND <high>
+    else if (strncmp(op, "count", 5) == 0) {
+        float low;
+        float high;
+        if (sscanf(op, "count mark between %f and %f", &low, &high) == 2) {
+            input_countMarks(low, high, console);
+        }
+        else {
+            outPrintf(console, "Follow this format to count marks: COUNT MARK BETWEEN <MARK> AND <MARK>.\n");
+            status = 1;
+        }
+    }
+    
+    else {
+        outPrintf(console, "Unrecognised input.\n");
+        status = 1;
+    }
+
+    outFlush(console);
+    return status;
 }
 
-
-int input_open(BTreeNode **root, const char *filename, int *num_students){
-    char line[MAX_LINE];
-    FILE *file = fopen(filename, "r");
-    if (file == NULL) {
-        perror("Failed to open file");
-        return 1;
-    }
-    char *token;
+/* ========== Server ========== */
+
+/*
+ * database --serve <port|path> [<file>] keeps one database in memory for many clients, on 127.0.0.1:<port>
+ * or a Unix socket at <path>. Clients send the same command lines as the prompt, as many as they like
+ * without waiting, and get each command's output followed by a line reading OK or FAILED, in order.
+ * One thread runs everything from an epoll loop, so commands never interleave, except QUERY ID= which
+ * goes to reader threads that search the tree alongside it (see Concurrent readers). A client waits for
+ * its query's answer before its next command runs, and OPEN waits for every query out with the readers.
+ */
+#ifdef __linux__
+#define SERVER_MAX_EVENTS 64
+#define CLIENT_LINE 256 // Same limit as the prompt, a longer line is cut like fgets would
+#define CLIENT_BACKLOG (1 << 20) // Unsent reply bytes at which a client's commands wait for it to catch up
+#define SERVER_READERS 4 // Threads answering QUERY ID=
+
+/* A QUERY ID= out with the readers */
+typedef struct ReadJob {
+    struct Client *client;
     int id;
-    char name[MAX_NAME];
-    char programme[MAX_PROGRAMME];
-    float mark;
-
-    while (fgets(line, sizeof(line), file)) {
-        // Remove newline at the end if present
-        line[strcspn(line, "\n")] = '\0';
-
-        if (line[0] == '\0') continue;
-        
-
-        // Parse line
-
-        token = strtok(line, ",");  // first token = studentID
-
-        id = safe_atoi(token, &id);
-
-        if (id == -1){
-            printf("Invalid ID!\n");
-            continue;
+    int found;
+    RecordCopy copy;
+    unsigned long long nodes_visited; // Added to the counters by the epoll loop, the readers never touch them
+    double seconds;
+    struct ReadJob *next;
+} ReadJob;
+
+typedef struct Client {
+    int fd;
+    char *input; // Received but not yet run
+    size_t input_used;
+    size_t input_size;
+    char *output; // Replies, output_sent of them already written
+    size_t output_used;
+    size_t output_sent;
+    size_t output_size;
+    bool closing; // The client has shut its end, finish its commands and replies then close
+    bool failed; // The connection broke, drop it
+    bool busy; // Its query is with the readers or its SAVE is waiting, the rest of its input waits for the answer
+    ReadJob query;
+    Checkpoint *save; // The write its SAVE waits on, NULL while the SAVE waits for another write to finish first
+    double save_started;
+    struct Client *next_saver; // In the server's list of clients with a SAVE out
+} Client;
+
+typedef struct ReaderPool {
+    BTreeNode **root;
+    ReadJob *queue; // Waiting for a reader, oldest first
+    ReadJob *queue_tail;
+    ReadJob *done; // Answered, waiting for the epoll loop
+    int in_flight; // Queued or being answered
+    int event_fd; // Readable while done has jobs, the epoll loop watches it
+    int started; // Reader threads running, with none every query runs on the epoll loop
+    bool stopping;
+#ifndef NO_THREADS
+    pthread_mutex_t lock;
+    pthread_cond_t wake; // A job was queued or the readers are stopping
+    pthread_cond_t idle; // in_flight came down to 0
+    pthread_t threads[SERVER_READERS];
+#endif
+} ReaderPool;
+
+#ifndef NO_THREADS
+void *readerWorker(void *arg){
+    ReaderPool *pool = arg;
+    pthread_mutex_lock(&pool->lock);
+    while (1){
+        while (pool->queue == NULL && !pool->stopping) pthread_cond_wait(&pool->wake, &pool->lock);
+        if (pool->queue == NULL) break;
+        ReadJob *job = pool->queue;
+        pool->queue = job->next;
+        pthread_mutex_unlock(&pool->lock);
+
+        STAT(double started = nowSeconds());
+        job->nodes_visited = 0;
+        job->found = searchIndexShared(pool->root, job->id, &job->copy, &job->nodes_visited);
+        STAT(job->seconds = nowSeconds() - started);
+
+        pthread_mutex_lock(&pool->lock);
+        job->next = pool->done;
+        pool->done = job;
+        if (--pool->in_flight == 0) pthread_cond_broadcast(&pool->idle);
+        uint64_t one = 1;
+        if (write(pool->event_fd, &one, sizeof(one)) < 0){
+            // Only fails when the counter is full, and then it is readable anyway
         }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+#endif
+
+/* Starts the reader threads, if none start the server still works with every query on the epoll loop */
+void readersStart(ReaderPool *pool, BTreeNode **root){
+    memset(pool, 0, sizeof(*pool));
+    pool->root = root;
+    pool->event_fd = -1;
+#ifndef NO_THREADS
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+    pool->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (pool->event_fd < 0) return;
+    while (pool->started < SERVER_READERS && pthread_create(&pool->threads[pool->started], NULL, readerWorker, pool) == 0){
+        pool->started++;
+    }
+#endif
+}
 
+/* Hands the client's QUERY ID= to the readers, false if there are none and it has to run here */
+bool readersSubmit(ReaderPool *pool, Client *client, int id){
+    if (pool->started == 0) return false;
+    ReadJob *job = &client->query;
+    job->client = client;
+    job->id = id;
+    job->next = NULL;
+    client->busy = true;
+#ifndef NO_THREADS
+    pthread_mutex_lock(&pool->lock);
+#endif
+    if (pool->queue == NULL) pool->queue = job;
+    else pool->queue_tail->next = job;
+    pool->queue_tail = job;
+    pool->in_flight++;
+#ifndef NO_THREADS
+    pthread_cond_signal(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+#endif
+    return true;
+}
 
-        token = strtok(NULL, ",");  // second token = name
-        if (token == NULL){
-            printf("Malformed input!\n");
-            continue;
-        }
-        strncpy(name, token, MAX_NAME);
+/* Waits until no reader is in the tree, for OPEN, which frees all of it */
+void readersDrain(ReaderPool *pool){
+#ifndef NO_THREADS
+    if (pool->started == 0) return;
+    pthread_mutex_lock(&pool->lock);
+    while (pool->in_flight > 0) pthread_cond_wait(&pool->idle, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+#else
+    (void)pool;
+#endif
+}
 
-        token = strtok(NULL, ",");  // third token = program]
-        if (token == NULL){
-            printf("Malformed input!\n");
-            continue;
-        }
-        strncpy(programme, token, MAX_PROGRAMME);
+/* The answered queries, in no particular order */
+ReadJob *readersTake(ReaderPool *pool){
+    if (pool->started == 0) return NULL;
+#ifndef NO_THREADS
+    pthread_mutex_lock(&pool->lock);
+#endif
+    ReadJob *done = pool->done;
+    pool->done = NULL;
+    uint64_t count;
+    if (read(pool->event_fd, &count, sizeof(count)) < 0){
+        // Nothing was signalled since the last take
+    }
+#ifndef NO_THREADS
+    pthread_mutex_unlock(&pool->lock);
+#endif
+    return done;
+}
 
-        token = strtok(NULL, ",");  // fourth token = mark
-        if (token == NULL){
-            printf("Malformed input!\n");
-            continue;
-        }
+void readersStop(ReaderPool *pool){
+#ifndef NO_THREADS
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->started; i++) pthread_join(pool->threads[i], NULL);
+    if (pool->event_fd >= 0) close(pool->event_fd);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->wake);
+    pthread_cond_destroy(&pool->idle);
+#else
+    (void)pool;
+#endif
+}
 
-        char *endptr;
+volatile sig_atomic_t server_stop = 0;
 
-        mark = strtof(token, &endptr);
+void serverSignal(int sig){
+    (void)sig;
+    server_stop = 1;
+}
 
-        if (*endptr == '\0') {// string converted
-            if (createAndInsert(root, id, name, programme, mark, num_students) == 1){
-                printf("Failure to insert for this record\n", id);
-                continue;
-            }
-        }
+/* Bytes an fgets of size max would take from data, 0 if it would have to wait for more */
+size_t lineLength(const char *data, size_t available, size_t max, bool closing){
+    size_t limit = available < max - 1 ? available : max - 1;
+    const char *newline = memchr(data, '\n', limit);
+    if (newline != NULL) return newline - data + 1;
+    if (limit == max - 1 || closing) return limit;
+    return 0;
+}
 
-        
+int clientAppend(char **buffer, size_t *used, size_t *size, const char *data, size_t len){
+    if (*used + len > *size){
+        size_t grown = *size ? *size : 4096;
+        while (grown < *used + len) grown *= 2;
+        char *bigger = realloc(*buffer, grown);
+        if (bigger == NULL) return 1;
+        *buffer = bigger;
+        *size = grown;
     }
-    
-    fclose(file);
-
+    memcpy(*buffer + *used, data, len);
+    *used += len;
     return 0;
-
 }
 
-void input_showSorted(BTreeNode *root, int *num_students, char *sortby, char *order){
-    bool isDescending = strcmp(order, "desc") == 0 ;
-    if (strcmp(sortby, "id") == 0){
-        printHeader();
-        traversal(root,  isDescending, NULL, NULL);
-    }
-    else if (strcmp(sortby, "mark") == 0){
-        printHeader();
-        showAllByMarks(root, num_students, isDescending);
-    }
-    else{
-        printf("Follow this format to sort the data: SHOW ALL SORT BY ID/MARK ASC/DESC.\n");
+/* Moves what the command wrote to reply, a memory stream, over to the client */
+void clientTakeReply(Client *client, OutBuffer *reply, char **reply_data){
+    outFlush(reply);
+
+    // The stream's buffer is only up to date after a flush, then it starts over for the next command
+    long len = fflush(reply->file) == 0 ? ftell(reply->file) : -1;
+    if (len < 0 || reply->failed
+        || clientAppend(&client->output, &client->output_used, &client->output_size, *reply_data, (size_t)len) == 1){
+        client->failed = true;
     }
+    rewind(reply->file);
+    reply->failed = false;
 }
 
+/* Ends a command's output with OK or FAILED and sends it all to the client */
+void clientReply(Client *client, int status, OutBuffer *reply, char **reply_data){
+    outPrintf(reply, status == 0 ? "OK\n" : "FAILED\n");
+    clientTakeReply(client, reply, reply_data);
+}
 
+/* Runs one command with its output going to reply */
+void clientRunLine(Database *db, Client *client, char *line, FILE *in, OutBuffer *reply, char **reply_data){
+    char op[CLIENT_LINE];
+    char raw[CLIENT_LINE];
+    line[strcspn(line, "\r\n")] = '\0';
+    strcpy(op, line);
+    strcpy(raw, line);
+    for (int i = 0; op[i]; i++) {
+        op[i] = tolower(op[i]);
+    }
 
-void input_showSummaryStatistics(BTreeNode *root, int *num_students){
-    /**
-     * summaryStatistics not null means we are using traversal for sumamry      
-     * summaryStatistics array will be in this format
-     * [<lowest_mark>,<highest_mark>,<id of student with lowest_mark>,<id of student with highest_mark>, <total_marks>]
-     */
-    float summaryStatistics[5] = {101.0,-1.0,0.0,0.0,0.0};
-    traversal(root,  false, summaryStatistics, NULL);
-    if (*num_students > 0){
-        printf("Total Number of students: %d\n", *num_students);
-        printf("Average Mark: %.1f\n",(summaryStatistics[4] / *num_students));
-        printf("Highest Mark: %.1f by Student %s\n", summaryStatistics[1], searchIndex(root, (int)summaryStatistics[3])->name);
-        printf("Lowest Mark: %.1f by Student %s\n", summaryStatistics[0], searchIndex(root, (int)summaryStatistics[2])->name);
-
+    STAT(double started = nowSeconds());
+    int status;
+    if (strncmp(op, "run ", 4) == 0) {
+        outPrintf(reply, "RUN can't be used over a connection.\n");
+        status = 1;
     }
-    else{
-        printf("No data found!\n");
+    else {
+        status = runCommand(db, op, raw, reply, in);
+    }
+    if (db->started_save != NULL){
+        // The SAVE's write is running, clientFinishSaves ends the reply once it is done
+        STAT(client->save_started = started);
+        clientTakeReply(client, reply, reply_data);
+        return;
     }
-    // for (int i = 0;i < 5; i++){
-    //     printf("summaryStatistics at position %d:%.1f\n",i, summaryStatistics[i]);
-    // }
+    STAT(recordCommand(op, status, nowSeconds() - started));
+    clientReply(client, status, reply, reply_data);
 }
 
-int parse_insert(char *input,
-                  int *id,
-                  char *name,
-                  char *programme,
-                  char *mark)
-{
-    input = input + strlen("insert ");//Remove insert at the start of the string
-    char *token = strtok(input, " ");
-    char *key, *value;
-   
-    printf("token:%s\n", token);
-
-
-    while (token != NULL) {
-
-        key = strtok(token, "=");
-        value = strtok(NULL, "");
-        printf("key:%s\n", key);
-        printf("value:%s\n",value);
+/* The client's SAVE waits on job, or with job NULL for the running write to finish before it starts */
+void clientAwaitSave(Client *client, Checkpoint *job, Client **savers){
+    client->busy = true;
+    client->save = job;
+    if (job != NULL) job->claimed = true;
+    client->next_saver = *savers;
+    *savers = client;
+}
 
-        if (key && value) {
-            if (strcmp(key, "id") == 0) {
-                safe_atoi(value, id);
-                if (*id == -1){
-                    return 1;
-                }
+/* The epoll loop's side of an answered QUERY ID=, the client can carry on with its next command */
+void clientFinishQuery(ReadJob *job, OutBuffer *reply, char **reply_data){
+    Client *client = job->client;
+    int status = printQueryId(job->id, job->found ? &job->copy : NULL, reply);
+    STAT(counters.searches++; counters.nodes_visited += job->nodes_visited);
+    STAT(recordCommand("query", status, job->seconds));
+    clientReply(client, status, reply, reply_data);
+    client->busy = false;
+}
 
-                printf("id:%s\n", value);
-                // strncpy(id, value, sizeof(id) - 1);
+/*
+ * Runs every complete command the client has sent, until its replies back up or it has a query out
+ * with the readers. Returns how many ran or went to the readers.
+ */
+int clientRunCommands(Database *db, Client *client, ReaderPool *readers, Client **savers, OutBuffer *reply, char **reply_data){
+    int ran = 0;
+    size_t pos = 0;
+    while (!client->failed && !client->busy && client->output_used - client->output_sent < CLIENT_BACKLOG){
+        char *data = client->input + pos;
+        size_t available = client->input_used - pos;
+        size_t len = lineLength(data, available, CLIENT_LINE, client->closing);
+        if (len == 0) break;
+
+        char line[CLIENT_LINE];
+        memcpy(line, data, len);
+        line[len] = '\0';
+        if (line[strspn(line, " \t\r\n")] == '\0'){
+            pos += len; // Blank lines are skipped, as in a script
+            continue;
+        }
+        char lowered[CLIENT_LINE];
+        for (size_t i = 0; i <= len; i++) lowered[i] = tolower((unsigned char)line[i]);
+        int id;
+        int end = 0;
+
+        size_t used = len;
+        if (sscanf(lowered, "query id=%d%n", &id, &end) == 1 && lowered[end + strspn(lowered + end, " \t\r\n")] == '\0'
+            && readersSubmit(readers, client, id)){
+            // Answered by a reader, busy holds back the rest of the input until clientFinishQuery
+        }
+        else if (sscanf(lowered, "insert id=%d", &id) == 1){
+            // INSERT reads name, programme and mark from the next three lines, wait until they are all here
+            size_t sizes[3] = {MAX_NAME, MAX_PROGRAMME, 6}; // The buffers input_insert reads them into
+            size_t offset = len;
+            int fields = 0;
+            for (; fields < 3; fields++){
+                size_t field = lineLength(data + offset, available - offset, sizes[fields], client->closing);
+                if (field == 0 && !client->closing) break;
+                offset += field;
             }
-            else if (strcmp(key, "name") == 0) {
-                printf("val1:%s\n", value);
-
-                strncpy(name, value, sizeof(name) - 1);
+            if (fields < 3) break;
+            FILE *in = available > len ? fmemopen(data + len, available - len, "r") : fopen("/dev/null", "r");
+            if (in == NULL){
+                client->failed = true;
+                break;
             }
-            else if (strcmp(key, "programme") == 0) {
-                printf("val2:%s\n", value);
-
-                strncpy(programme, value, sizeof(programme) - 1);
+            clientRunLine(db, client, line, in, reply, reply_data);
+            used = len + ftell(in);
+            fclose(in);
+        }
+        else if (strncmp(lowered, "save", 4) == 0 && (lowered[4] == '\0' || isspace((unsigned char)lowered[4]))
+                 && (db->save.running || db->wal.checkpoint.running)){
+            // Starting it now would wait for that write on the epoll loop, it runs once the write is done instead
+            clientAwaitSave(client, NULL, savers);
+            break;
+        }
+        else {
+            if (strncmp(lowered, "open", 4) == 0) readersDrain(readers);
+            clientRunLine(db, client, line, NULL, reply, reply_data);
+            if (db->started_save != NULL){
+                clientAwaitSave(client, db->started_save, savers);
+                db->started_save = NULL;
             }
-            else if (strcmp(key, "mark") == 0) {
-                printf("val3:%s\n", value);
+        }
+        pos += used;
+        ran++;
+    }
+    memmove(client->input, client->input + pos, client->input_used - pos);
+    client->input_used -= pos;
+    return ran;
+}
 
-                strncpy(mark, value, sizeof(programme) - 1);
+void clientRead(Client *client){
+    while (1){
+        if (client->input_used == client->input_size){
+            size_t grown = client->input_size ? client->input_size * 2 : 4096;
+            char *bigger = realloc(client->input, grown);
+            if (bigger == NULL){
+                client->failed = true;
+                return;
             }
+            client->input = bigger;
+            client->input_size = grown;
+        }
+        ssize_t got = read(client->fd, client->input + client->input_used, client->input_size - client->input_used);
+        if (got > 0){
+            client->input_used += got;
+        }
+        else if (got == 0){
+            client->closing = true;
+            return;
+        }
+        else {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) client->failed = true;
+            return;
         }
-
-        token = strtok(NULL, " ");
     }
-    return 0;
 }
 
-// void input_insert(BTreeNode **root, int *id,int* num_students, char* name, char *programme, char *mark){
-
-//         char *endptr;
-
-//         float f = strtof(mark, &endptr);
-
-//         if (*endptr == '\0') {// string converted
-//             if (createAndInsert(root, *id, name, programme, f, num_students) == 1){
-//                 printf("Insertion failed!\n");
-//             }
-//         }
-//         else{
-            
-//             printf("Invalid Input!\n");
-//         }
-    
-
-// }
-
-void input_insert(BTreeNode **root, int id,int* num_students){
-    char name[MAX_NAME];
-    char programme[MAX_PROGRAMME];
-    char mark[6];
+void clientFlush(Client *client){
+    while (client->output_sent < client->output_used){
+        ssize_t sent = send(client->fd, client->output + client->output_sent, client->output_used - client->output_sent, MSG_NOSIGNAL);
+        if (sent > 0){
+            client->output_sent += sent;
+        }
+        else if (sent < 0 && errno == EINTR){
+            continue;
+        }
+        else {
+            if (sent == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) client->failed = true;
+            return;
+        }
+    }
+    client->output_sent = 0;
+    client->output_used = 0;
+}
 
-    printf("Name= ");
-    fgets(name, sizeof(name), stdin);
-    name[strcspn(name, "\n")] =  '\0';
+void clientClose(int epoll_fd, Client *client){
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+    close(client->fd);
+    free(client->input);
+    free(client->output);
+    free(client);
+}
 
-    printf("Programme= ");
-    fgets(programme, sizeof(programme), stdin);
-    programme[strcspn(programme, "\n")] =  '\0';
+/* Runs what the client sent and sends what it can, then waits for whatever it needs next. Closes it once it is done */
+void clientService(Database *db, int epoll_fd, Client *client, ReaderPool *readers, Client **savers, OutBuffer *reply, char **reply_data){
+    // Replies can unblock more commands, keep going until neither side moves
+    while (!client->failed){
+        bool backed_up = client->output_used - client->output_sent >= CLIENT_BACKLOG;
+        int ran = clientRunCommands(db, client, readers, savers, reply, reply_data);
+        clientFlush(client);
+        // Nothing ran, go again only if that was the backlog and the flush just cleared it
+        if (ran == 0 && (!backed_up || client->output_used > 0)) break;
+    }
 
-    printf("Mark= ");
-    fgets(mark, sizeof(mark), stdin);
-    char *endPtr;
-    float f = strtof(mark, &endPtr);
+    bool backed_up = client->output_used - client->output_sent >= CLIENT_BACKLOG;
+    bool pending = client->output_sent < client->output_used;
+    // A query out with the readers or a waiting SAVE still points at the client, it is closed once the answer is in
+    if (!client->busy && (client->failed || (client->closing && !pending))){
+        clientClose(epoll_fd, client);
+        return;
+    }
+    struct epoll_event event = {0};
+    event.events = (client->closing || client->failed || backed_up ? 0 : EPOLLIN) | (pending && !client->failed ? EPOLLOUT : 0);
+    event.data.ptr = client;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->fd, &event);
+}
 
-    if (*endPtr == '\n') {// string converted
-        if (createAndInsert(root, id, name, programme, f, num_students) == 1){
-            printf("Insertion failed!\n");
+/* Answers each SAVE whose write is done and lets the ones waiting for a write start theirs */
+void clientFinishSaves(Database *db, int epoll_fd, ReaderPool *readers, Client **savers, OutBuffer *reply, char **reply_data){
+    Client *ready = NULL;
+    Client **link = savers;
+    while (*link != NULL){
+        Client *client = *link;
+        Checkpoint *job = client->save;
+        bool finished = job != NULL && (!job->running || __atomic_load_n(&job->done, __ATOMIC_ACQUIRE));
+        bool can_start = job == NULL && !db->save.running && !db->wal.checkpoint.running;
+        if (!finished && !can_start){
+            link = &client->next_saver;
+            continue;
+        }
+        *link = client->next_saver;
+        if (finished){
+            job->claimed = false;
+            // An OPEN in between may have finished the job already, its result is still there
+            int status = job->running ? checkpointFinish(job, reply) : job->result;
+            STAT(recordCommand("save", status, nowSeconds() - client->save_started));
+            clientReply(client, status, reply, reply_data);
         }
+        client->busy = false;
+        client->save = NULL;
+        client->next_saver = ready;
+        ready = client;
     }
-    else{
-        printf("Marks are invalid!\n");
+    // Only now, a SAVE that runs here can put its client back on the list
+    while (ready != NULL){
+        Client *client = ready;
+        ready = client->next_saver;
+        clientService(db, epoll_fd, client, readers, savers, reply, reply_data);
     }
-
 }
 
-void insertDataForTesting(BTreeNode **root, int * p_num_students){
-    createAndInsert(root,
-                2502841,
-                "Alicia Tan",
-                "Computer Science",
-                72.5,
-            p_num_students);
+/* Listening socket for "<port>" on 127.0.0.1 or "<path>" as a Unix socket, -1 on failure */
+int serverListen(const char *address){
+    int fd;
+    if (strspn(address, "0123456789") == strlen(address)){
+        struct sockaddr_in addr = {0};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(atoi(address));
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK); // Local tools only, there is no authentication
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        int on = 1;
+        if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0
+            || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0){
+            if (fd >= 0) close(fd);
+            return -1;
+        }
+    }
+    else {
+        struct sockaddr_un addr = {0};
+        if (strlen(address) >= sizeof(addr.sun_path)) return -1;
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, address);
+        unlink(address); // Left behind by a server that did not shut down cleanly
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0){
+            if (fd >= 0) close(fd);
+            return -1;
+        }
+    }
+    if (listen(fd, SOMAXCONN) != 0){
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
 
-    createAndInsert(root,
-                    2509174,
-                    "Marcus Lim",
-                    "Information Security",
-                    64.0,
-                p_num_students);
+/* Serves clients until SIGINT or SIGTERM, returns 1 if the server could not start */
+int serve(Database *db, const char *address){
+    int listen_fd = serverListen(address);
+    if (listen_fd < 0){
+        printf("Cannot listen on %s.\n", address);
+        return 1;
+    }
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    // Every command's output is collected here, in memory, and then appended to its client's replies
+    char *reply_data = NULL;
+    size_t reply_size = 0;
+    FILE *reply_file = open_memstream(&reply_data, &reply_size);
+    OutBuffer *reply = reply_file != NULL ? outOpen(reply_file, false) : NULL;
+    if (epoll_fd < 0 || reply == NULL){
+        printf("The server could not start.\n");
+        close(listen_fd);
+        if (epoll_fd >= 0) close(epoll_fd);
+        if (reply_file != NULL) fclose(reply_file);
+        free(reply_data);
+        return 1;
+    }
+    struct epoll_event event = {0};
+    event.events = EPOLLIN;
+    event.data.ptr = NULL; // The listening socket
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event);
+
+    signal(SIGINT, serverSignal);
+    signal(SIGTERM, serverSignal);
+    batch_mode = true; // Replies end in OK or FAILED, the success messages and INSERT prompts would only get in the way
+    printf("Listening on %s.\n", address);
+    fflush(stdout);
+
+    Client *savers = NULL; // Clients whose SAVE waits on a write
+    db->defer_saves = true;
+    ReaderPool readers;
+    readersStart(&readers, &db->root);
+    if (readers.started > 0){
+        event.events = EPOLLIN;
+        event.data.ptr = &readers;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, readers.event_fd, &event);
+    }
 
-    createAndInsert(root,
-                    2505532,
-                    "Samantha Ong",
-                    "Data Analytics",
-                    81.0,
-                p_num_students);
+    struct epoll_event events[SERVER_MAX_EVENTS];
+    while (!server_stop){
+        bool answered = false;
+        // Wake up now and then while a background write runs, so its result is logged when it is done
+        int ready = epoll_wait(epoll_fd, events, SERVER_MAX_EVENTS, db->save.running || db->wal.checkpoint.running ? 100 : -1);
+        if (ready < 0){
+            if (errno == EINTR) continue;
+            break;
+        }
+        for (int i = 0; i < ready; i++){
+            Client *client = events[i].data.ptr;
+            if (client == NULL){
+                int fd;
+                while ((fd = accept(listen_fd, NULL, NULL)) >= 0){
+                    client = calloc(1, sizeof(Client));
+                    if (client == NULL || fcntl(fd, F_SETFL, O_NONBLOCK) != 0){
+                        free(client);
+                        close(fd);
+                        continue;
+                    }
+                    client->fd = fd;
+                    event.events = EPOLLIN;
+                    event.data.ptr = client;
+                    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+                }
+                continue;
+            }
 
-    createAndInsert(root,
-                    2503328,
-                    "Rahul Nair",
-                    "Software Engineering",
-                    49.5,
-                p_num_students);
+            if ((void *)client == (void *)&readers){
+                answered = true; // Handled once this round is over, so no client in events is closed before its turn
+                continue;
+            }
 
-    createAndInsert(root,
-                    2507769,
-                    "Chloe Wong",
-                    "Business Analytics",
-                    90.0,
-                p_num_students);
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) clientRead(client);
+            clientService(db, epoll_fd, client, &readers, &savers, reply, &reply_data);
+        }
+        if (answered){
+            ReadJob *job = readersTake(&readers);
+            while (job != NULL){
+                ReadJob *next = job->next;
+                Client *client = job->client;
+                clientFinishQuery(job, reply, &reply_data);
+                clientService(db, epoll_fd, client, &readers, &savers, reply, &reply_data);
+                job = next;
+            }
+        }
 
-    createAndInsert(root,
-                    2504417,
-                    "Nicholas Lee",
-                    "Applied AI",
-                    58.0,
-                p_num_students);
+        clientFinishSaves(db, epoll_fd, &readers, &savers, reply, &reply_data);
+        checkpointPoll(&db->save);
+        checkpointPoll(&db->wal.checkpoint);
+        outFlush(db->wal.checkpoint.log);
+        fflush(stdout);
+    }
 
-    createAndInsert(root,
-                    2506355,
-                    "Emily Chan",
-                    "Cybersecurity",
-                    73.0,
-                p_num_students);
+    readersStop(&readers); // Before anything else touches the tree
+    db->defer_saves = false;
+    // Nobody is left to answer, a SAVE still being written is reported like any other background write
+    db->save.claimed = false;
+    db->wal.checkpoint.claimed = false;
+    printf("Server stopped.\n");
+    close(listen_fd);
+    close(epoll_fd);
+    free(reply);
+    fclose(reply_file);
+    free(reply_data);
+    if (strspn(address, "0123456789") != strlen(address)) unlink(address);
+    return 0;
 }
+#endif
 
 
+int main(int argc, char **argv){
+#ifdef BENCHMARK
+    // database --generate <rows> <file> writes a synthetic dataset, database --benchmark times the commands
+    if (argc == 4 && strcmp(argv[1], "--generate") == 0){
+        return generateDataset(argv[3], atoi(argv[2]));
+    }
+    if (argc >= 2 && argc <= 4 && strcmp(argv[1], "--benchmark") == 0){
+        return benchmark(argc > 2 ? atoi(argv[2]) : 1000000, argc > 3 ? argv[3] : "benchmark.jsonl");
+    }
+#ifndef NO_THREADS
+    // database --stress [<readers>] [<changes>] checks QUERY ID= readers against a writer
+    if (argc >= 2 && argc <= 4 && strcmp(argv[1], "--stress") == 0){
+        return stressTest(argc > 2 ? atoi(argv[2]) : 4, argc > 3 ? atoi(argv[3]) : 1000000);
+    }
+#endif
+#endif
+    Database db = {NULL, 0, "P2_1-CMS.txt", {0}, {0}, false, NULL};
+    OutBuffer *console = outOpen(stdout, false);
+    if (console == NULL){
+        printf("Memory allocation failed.\n");
+        return 1;
+    }
+    // Background writes report here, between commands, so in server mode they go to the server's log
+    db.save.log = console;
+    db.wal.checkpoint.log = console;
 
-int main(){
-    BTreeNode *root = NULL;
-    int num_students = 0;
-    int* p_num_students = &num_students;
-    char filename[256] = "P2_1-CMS.txt";
-
-
-    // insertDataForTesting(&root, p_num_students);
+    // insertDataForTesting(&db.root, &db.num_students, console);
 
     char op[256];
-    int id;
+    char raw[256]; // Input before lowering, file names keep their case
+
+#ifdef __linux__
+    // database --serve <port|path> [<file>] opens the file if one is named, then serves it until stopped
+    if (argc >= 3 && argc <= 4 && strcmp(argv[1], "--serve") == 0){
+        int result = 0;
+        if (argc == 4){
+            char op[256];
+            snprintf(op, sizeof(op), "open %s", argv[3]);
+            result = runCommand(&db, op, op, console, stdin);
+        }
+        if (result == 0) result = serve(&db, argv[2]);
+        checkpointSettle(&db.save);
+        walClose(&db.wal);
+        if (checkpointPoll(&db.save) + checkpointPoll(&db.wal.checkpoint) > 0) result = 1;
+        outFlush(console);
+        free(console);
+        destroyDatabase(&db.root, &db.num_students);
+        return result;
+    }
+#endif
+
+    // database --batch [script] runs a command stream without prompts, from stdin if no script is named
+    FILE *in = stdin;
+    bool batch_only = false; // Started with --batch, the program ends with the stream
+    if (argc > 1){
+        if (strcmp(argv[1], "--batch") != 0 || argc > 3){
+            printf("Usage: %s [--batch [<script>]]\n", argv[0]);
+#ifdef __linux__
+            printf("       %s --serve <port|path> [<file>]\n", argv[0]);
+#endif
+#ifdef BENCHMARK
+            printf("       %s --generate <rows> <file>\n       %s --benchmark [<max rows>] [<report>]\n", argv[0], argv[0]);
+#ifndef NO_THREADS
+            printf("       %s --stress [<readers>] [<changes>]\n", argv[0]);
+#endif
+#endif
+            return 1;
+        }
+        if (argc == 3 && (in = fopen(argv[2], "r")) == NULL){
+            printf("Cannot open script %s.\n", argv[2]);
+            return 1;
+        }
+        batch_mode = true;
+        batch_only = true;
+        setvbuf(stdout, NULL, _IOFBF, OUT_BUFFER_SIZE); // Nobody is waiting on a prompt, let stdout fill up
+    }
+    int commands = 0; // Counted for the tally of a script
+    int failed = 0;
 
     while (1) {
-        printf("\nEnter your command:");
-        fgets(op, sizeof(op), stdin);
+        // A write that finished in the background is reported before the next command, and fails a script
+        int background_failed = checkpointPoll(&db.save) + checkpointPoll(&db.wal.checkpoint);
+        outFlush(console);
+        if (batch_mode) failed += background_failed;
+
+        if (!batch_mode) printf("\nEnter your command:");
+        if (fgets(op, sizeof(op), in) == NULL) {
+            if (!batch_mode) break; // End of input
+            batchTally(commands, failed);
+            if (batch_only) break;
+            // End of a RUN script, back to the prompt
+            fclose(in);
+            in = stdin;
+            batch_mode = false;
+            continue;
+        }
         op[strcspn(op, "\n")] = 0;
+        strcpy(raw, op);
+        if (batch_mode && op[0] == '\0') continue; // Blank lines in scripts are fine
+        int status = 0; // Set to 1 by any command that fails
+        STAT(double started = nowSeconds());
 
         // Lower user input
         for (int i = 0; op[i]; i++) {
             op[i] = tolower(op[i]);
         }
 
-        // // OPEN
-        if (strcmp(op, "open") == 0) {
-            int open_results = input_open(&root, filename, p_num_students);
-            if(num_students != 0 && open_results != 1){
-                printf("The database file \"%s\" is successfully opened.\n", filename);
+        // RUN <script>, the commands in the file run in batch mode
+        if (strncmp(op, "run ", 4) == 0) {
+            char script[256];
+            if (batch_mode) {
+                printf("RUN can't be used inside a script.\n");
+                status = 1;
             }
-            else{
-                printf("Opening went wrong\n");
-            }
-        }
-        // SHOW ALL
-        else if (strcmp(op, "show all") == 0) {
-            printf("Here are all the records found in StudentRecords \n");
-            printHeader();
-            traversal(root, false, NULL, NULL);
-            // showAllById(root, false);
-        }
-        // SHOW ALL SORTED
-        else if (strstr(op, "show all sort") != NULL) {
-            char sortby[10];
-            char order[10];
-            if (sscanf(op, "show all sort by %s %s", sortby, order) == 2 
-                && ((strcmp(order, "desc") == 0) || (strcmp(order, "asc") == 0))){
-                input_showSorted(root, p_num_students, sortby, order);
+            else if (sscanf(raw + 4, "%255s", script) != 1 || (in = fopen(script, "r")) == NULL) {
+                printf("Cannot open script %s.\n", raw + 4);
+                in = stdin;
+                status = 1;
             }
             else {
-                printf("Follow this format to sort the data: SHOW ALL SORT BY ID/MARK ASC/DESC.\n");
+                batch_mode = true;
+                commands = 0;
+                failed = 0;
+                continue;
             }
         }
-        
-        // INSERT
-        else if (strstr(op, "insert") != NULL) {
-            if (sscanf(op, "insert id=%d", &id) == 1) {
-
-            input_insert(&root, id, p_num_students);
-            }
+        else {
+            status = runCommand(&db, op, raw, console, in);
         }
 
-       
-        // QUERY
-        else if (strstr(op, "query") != NULL) {
-            if (sscanf(op, "query id=%d", &id) == 1) {
-                StudentRecord * rec = searchIndex(root, id);
-                if(rec) {
-                    printHeader();
-                    printRecord(rec , NULL);
-                }
-                else{
-                    printf("ID %d not found!\n",id );
-                }
-                
-            }
-            else {
-                printf("Follow this format to make a query: QUERY ID=<ID NUMBER>.\n");
-            }
-        }
-        // UPDATE
-        else if (strstr(op, "update") != NULL) {
-            char field[MAX_PROGRAMME];
-            char value[MAX_PROGRAMME];
-            if (sscanf(op, "update id=%d %[^=]=%[^\n]", &id, field, value) == 3) {
-                updateStudentRecord(root, id, field, value);
-            }
-            else {
-                printf("Follow this format to update: UPDATE ID=<ID Number> <Field>=<Value>.\nExample: UPDATE ID=2801234 MARK=98.7\n.");
-            }
-        }
-        // DELETE
-        else if (strstr(op, "delete") != NULL) {
-            if (sscanf(op, "delete id=%d", &id) == 1) {
-                deleteKey(&root, id, p_num_students);
-            }
-            else {
-                printf("Follow this format to delete data: DELETE ID=<ID NUMBER>.\n");
+        STAT(recordCommand(op, status, nowSeconds() - started));
+
+        if (batch_mode) {
+            commands++;
+            if (status != 0) {
+                failed++;
+                printf("Command %d failed: %s\n", commands, raw);
             }
         }
-        // SAVE
-        else if (strcmp(op, "save") == 0) {
-            input_save(root, filename);
-        }
-        // SUMMARY
-        else if (strcmp(op, "show summary") == 0) {
-           input_showSummaryStatistics(root, p_num_students);
-        }
-        
-        else {
-            printf("Unrecognised input.\n");
-        }
     }
 
+    if (in != stdin) fclose(in);
+    checkpointSettle(&db.save);
+    walClose(&db.wal);
+    failed += checkpointPoll(&db.save) + checkpointPoll(&db.wal.checkpoint);
+    outFlush(console);
+    free(console);
+    destroyDatabase(&db.root, &db.num_students);
     
-    
-    return 0;
+    return batch_only && failed > 0 ? 1 : 0; // Lets a job runner notice a script with errors
 
 }
\ No newline at end of file